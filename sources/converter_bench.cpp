@@ -0,0 +1,630 @@
+/**
+ * @file converter_bench.cpp
+ * @brief Throughput benchmark of root2parquet and parquet2root on synthetic data
+ *
+ * Generates a ROOT tree and a parquet file holding the same synthetic events, with a configurable
+ * mix of scalars, fixed size arrays, variable size arrays with a size branch, vector<T> and RVec<T>,
+ * in a tall (few columns, many events) and a wide (many columns, few events) layout.
+ * Both converters are then run on them and the best wall time of a few repetitions is reported
+ * as MB/s of input and events/s. With --check, the ROOT data is also converted to parquet and back
+ * and compared with the original.
+ *
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+#include <cstdlib>
+#include <cstdio>
+#include <getopt.h>
+#include "TFile.h"
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TObjArray.h"
+#include "ROOT/RVec.hxx"
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <parquet/arrow/writer.h>
+
+/** prints usage **/
+void usage(char *argv0)
+{
+    std::cout << "[converter_bench]: Usage: \n"
+              << argv0 << " [-o work_directory] [options]\n"
+              << "-o [work_directory] directory of the generated and converted files (default: ./bench)\n"
+              << "-n [events] events of the tall layout; the wide layout has events / 32 (default: 1000000)\n"
+              << "-c [columns] columns of each kind in the tall layout; the wide layout has 32 times more (default: 2)\n"
+              << "-m, --mix [scalar,fixed,var,vector,rvec] kinds of columns generated (default: all)\n"
+              << "-L, --layout [tall|wide|both] (default: both)\n"
+              << "-a, --array-size [n] size of the fixed arrays and mean size of the variable ones (default: 8)\n"
+              << "-r, --repetitions [n] runs of each conversion, the best is reported (default: 3)\n"
+              << "-d, --tools-dir [directory] directory of root2parquet and parquet2root (default: directory of this program)\n"
+              << "--root2parquet-args [\"args\"] extra arguments of root2parquet, e.g. \"-e bulk -j 4\"\n"
+              << "--parquet2root-args [\"args\"] extra arguments of parquet2root, e.g. \"-t 4 -c lz4\"\n"
+              << "--json [file] write the results as JSON\n"
+              << "--check convert the ROOT data to parquet and back, and check the result against the original\n"
+              << "--keep-data reuse generated files of a previous run with the same settings"
+              << std::endl;
+}
+
+/** Returns a random value of type T */
+template <typename T>
+T RandomValue(std::mt19937_64 &rng)
+{
+    if constexpr (std::is_same_v<T, bool>)
+        return rng() & 1;
+    else if constexpr (std::is_floating_point_v<T>)
+        return std::uniform_real_distribution<T>(0, 100)(rng);
+    else
+        return static_cast<T>(std::uniform_int_distribution<int64_t>(0, 1000)(rng));
+}
+
+/** ROOT leaf type code of T */
+template <typename T>
+constexpr char LeafCode()
+{
+    if constexpr (std::is_same_v<T, double>)
+        return 'D';
+    else if constexpr (std::is_same_v<T, float>)
+        return 'F';
+    else if constexpr (std::is_same_v<T, int32_t>)
+        return 'I';
+    else if constexpr (std::is_same_v<T, int64_t>)
+        return 'L';
+    else if constexpr (std::is_same_v<T, int16_t>)
+        return 'S';
+    else if constexpr (std::is_same_v<T, uint32_t>)
+        return 'i';
+    else
+        return 'O';
+}
+
+/**
+ * One synthetic column
+ * Generate() draws the values of the next event, which are then filled into the tree through the
+ * branch address and appended to the Arrow builder by Append()
+ */
+class SyntheticColumn
+{
+public:
+    virtual ~SyntheticColumn() = default;
+    virtual void Branch(TTree &tree) = 0;
+    virtual void Generate(std::mt19937_64 &rng) = 0;
+    virtual void Append() = 0;
+    virtual std::shared_ptr<arrow::ArrayBuilder> builder() const = 0;
+    std::shared_ptr<arrow::Field> field() const { return arrow::field(name_, builder()->type()); }
+
+protected:
+    explicit SyntheticColumn(const std::string &name) : name_(name) {}
+    std::string name_;
+};
+
+/** Scalar column, leaf name/code */
+template <typename T>
+class ScalarColumn : public SyntheticColumn
+{
+public:
+    explicit ScalarColumn(const std::string &name)
+        : SyntheticColumn(name), builder_(std::make_shared<typename arrow::CTypeTraits<T>::BuilderType>()) {}
+    void Branch(TTree &tree) override { tree.Branch(name_.c_str(), &value_, (name_ + "/" + LeafCode<T>()).c_str()); }
+    void Generate(std::mt19937_64 &rng) override { value_ = RandomValue<T>(rng); }
+    void Append() override { PARQUET_THROW_NOT_OK(builder_->Append(value_)); }
+    std::shared_ptr<arrow::ArrayBuilder> builder() const override { return builder_; }
+
+private:
+    T value_{};
+    std::shared_ptr<typename arrow::CTypeTraits<T>::BuilderType> builder_;
+};
+
+/** How a list column is written to ROOT: name[n], name[n_name], vector<T> or RVec<T> */
+enum class ListKind
+{
+    kFixed,
+    kVariable,
+    kVector,
+    kRVec
+};
+
+/** Column of a list of values per event, all converted to Arrow lists */
+template <typename T>
+class ListColumn : public SyntheticColumn
+{
+public:
+    ListColumn(const std::string &name, ListKind kind, int size)
+        : SyntheticColumn(name), kind_(kind), size_(size), values_(kind == ListKind::kFixed ? size : 2 * size),
+          valueBuilder_(std::make_shared<typename arrow::CTypeTraits<T>::BuilderType>()),
+          builder_(std::make_shared<arrow::ListBuilder>(arrow::default_memory_pool(), valueBuilder_))
+    {
+    }
+    void Branch(TTree &tree) override
+    {
+        const std::string leaf = name_ + "[" + (kind_ == ListKind::kFixed ? std::to_string(size_) : "n_" + name_) + "]/" + LeafCode<T>();
+        switch (kind_)
+        {
+        case ListKind::kFixed:
+            tree.Branch(name_.c_str(), values_.data(), leaf.c_str());
+            break;
+        case ListKind::kVariable:
+            tree.Branch(("n_" + name_).c_str(), &count_, ("n_" + name_ + "/I").c_str());
+            tree.Branch(name_.c_str(), values_.data(), leaf.c_str());
+            break;
+        case ListKind::kVector:
+            vectorPtr_ = &values_;
+            tree.Branch(name_.c_str(), &vectorPtr_);
+            break;
+        case ListKind::kRVec:
+            rvecPtr_ = &rvec_;
+            tree.Branch(name_.c_str(), &rvecPtr_);
+            break;
+        }
+    }
+    void Generate(std::mt19937_64 &rng) override
+    {
+        // Variable sizes are uniform in [0, 2 * size]
+        count_ = kind_ == ListKind::kFixed ? size_ : std::uniform_int_distribution<int>(0, 2 * size_)(rng);
+        if (kind_ == ListKind::kVector)
+            values_.resize(count_);
+        for (int i = 0; i < count_; ++i)
+            values_[i] = RandomValue<T>(rng);
+        if (kind_ == ListKind::kRVec)
+            rvec_.assign(values_.begin(), values_.begin() + count_);
+    }
+    void Append() override
+    {
+        PARQUET_THROW_NOT_OK(builder_->Append());
+        PARQUET_THROW_NOT_OK(valueBuilder_->AppendValues(values_.data(), count_));
+    }
+    std::shared_ptr<arrow::ArrayBuilder> builder() const override { return builder_; }
+
+private:
+    ListKind kind_;
+    int size_;
+    Int_t count_ = 0;
+    std::vector<T> values_;
+    std::vector<T> *vectorPtr_ = nullptr;
+    ROOT::RVec<T> rvec_;
+    ROOT::RVec<T> *rvecPtr_ = nullptr;
+    std::shared_ptr<typename arrow::CTypeTraits<T>::BuilderType> valueBuilder_;
+    std::shared_ptr<arrow::ListBuilder> builder_;
+};
+
+/** Settings of the generated data */
+struct DataSpec
+{
+    std::string layout;
+    long long events = 0;
+    int columnsPerKind = 0;
+    std::vector<std::string> mix;
+    int arraySize = 8;
+};
+
+/** Creates the columns of spec; element types cycle through the supported types */
+std::vector<std::unique_ptr<SyntheticColumn>> MakeColumns(const DataSpec &spec)
+{
+    std::vector<std::unique_ptr<SyntheticColumn>> columns;
+    for (const auto &kind : spec.mix)
+    {
+        for (int i = 0; i < spec.columnsPerKind; ++i)
+        {
+            const std::string name = kind + "_" + std::to_string(i);
+            if (kind == "scalar")
+            {
+                switch (i % 7)
+                {
+                case 0: columns.emplace_back(std::make_unique<ScalarColumn<double>>(name)); break;
+                case 1: columns.emplace_back(std::make_unique<ScalarColumn<float>>(name)); break;
+                case 2: columns.emplace_back(std::make_unique<ScalarColumn<int32_t>>(name)); break;
+                case 3: columns.emplace_back(std::make_unique<ScalarColumn<int64_t>>(name)); break;
+                case 4: columns.emplace_back(std::make_unique<ScalarColumn<int16_t>>(name)); break;
+                case 5: columns.emplace_back(std::make_unique<ScalarColumn<uint32_t>>(name)); break;
+                default: columns.emplace_back(std::make_unique<ScalarColumn<bool>>(name)); break;
+                }
+                continue;
+            }
+            ListKind listKind = kind == "fixed"    ? ListKind::kFixed
+                                : kind == "var"    ? ListKind::kVariable
+                                : kind == "vector" ? ListKind::kVector
+                                                   : ListKind::kRVec;
+            switch (i % 3)
+            {
+            case 0: columns.emplace_back(std::make_unique<ListColumn<double>>(name, listKind, spec.arraySize)); break;
+            case 1: columns.emplace_back(std::make_unique<ListColumn<float>>(name, listKind, spec.arraySize)); break;
+            default: columns.emplace_back(std::make_unique<ListColumn<int32_t>>(name, listKind, spec.arraySize)); break;
+            }
+        }
+    }
+    return columns;
+}
+
+/**
+ * Writes the same synthetic events into rootFileName (tree "tree") and parquetFileName
+ * The parquet file is written in row groups of 65536 events
+ */
+void GenerateData(const DataSpec &spec, const std::string &rootFileName, const std::string &parquetFileName)
+{
+    const long long rowGroupEvents = 65536;
+    auto columns = MakeColumns(spec);
+    std::mt19937_64 rng(12345);
+
+    TFile rootFile(rootFileName.c_str(), "RECREATE");
+    if (rootFile.IsZombie())
+    {
+        throw std::runtime_error("Failed to create " + rootFileName);
+    }
+    TTree tree("tree", "Synthetic benchmark data");
+    arrow::FieldVector fields;
+    for (auto &column : columns)
+    {
+        column->Branch(tree);
+        fields.emplace_back(column->field());
+    }
+    auto schema = arrow::schema(fields);
+
+    std::shared_ptr<arrow::io::FileOutputStream> outfile;
+    PARQUET_ASSIGN_OR_THROW(outfile, arrow::io::FileOutputStream::Open(parquetFileName));
+    std::unique_ptr<parquet::arrow::FileWriter> writer;
+    PARQUET_ASSIGN_OR_THROW(writer, parquet::arrow::FileWriter::Open(*schema, arrow::default_memory_pool(), outfile,
+                                                                     parquet::default_writer_properties()));
+    auto writeRowGroup = [&]()
+    {
+        arrow::ArrayVector arrays;
+        for (auto &column : columns)
+        {
+            std::shared_ptr<arrow::Array> array;
+            PARQUET_THROW_NOT_OK(column->builder()->Finish(&array));
+            arrays.emplace_back(array);
+        }
+        auto table = arrow::Table::Make(schema, arrays);
+        PARQUET_THROW_NOT_OK(writer->WriteTable(*table, table->num_rows()));
+    };
+
+    for (long long event = 0; event < spec.events; ++event)
+    {
+        for (auto &column : columns)
+        {
+            column->Generate(rng);
+            column->Append();
+        }
+        tree.Fill();
+        if ((event + 1) % rowGroupEvents == 0)
+            writeRowGroup();
+    }
+    if (spec.events % rowGroupEvents != 0)
+        writeRowGroup();
+    PARQUET_THROW_NOT_OK(writer->Close());
+    PARQUET_THROW_NOT_OK(outfile->Close());
+    tree.Write();
+    rootFile.Close();
+}
+
+/**
+ * Compares the tree of convertedFileName, converted from originalFileName to parquet and back, with the original
+ * Every branch of the original must be found exactly once, with the same number of entries, and variable size
+ * arrays must have the same sizes and values in every entry, read through their count leaves.
+ * Returns the differences found, empty if none
+ */
+std::vector<std::string> CheckRoundTrip(const std::string &originalFileName, const std::string &convertedFileName)
+{
+    std::vector<std::string> problems;
+    TFile originalFile(originalFileName.c_str());
+    TFile convertedFile(convertedFileName.c_str());
+    if (originalFile.IsZombie() || convertedFile.IsZombie())
+    {
+        return {"cannot open " + originalFileName + " or " + convertedFileName};
+    }
+    auto *original = originalFile.Get<TTree>("tree");
+    auto *converted = convertedFile.Get<TTree>("tree");
+    if (!original || !converted)
+    {
+        return {"tree not found"};
+    }
+    if (original->GetEntries() != converted->GetEntries())
+    {
+        problems.emplace_back("entries " + std::to_string(converted->GetEntries()) + " instead of " +
+                              std::to_string(original->GetEntries()));
+    }
+
+    std::map<std::string, int> branchCounts;
+    TObjArray *convertedBranches = converted->GetListOfBranches();
+    for (Int_t i = 0; i < convertedBranches->GetEntriesFast(); ++i)
+        branchCounts[convertedBranches->At(i)->GetName()]++;
+    for (const auto &[name, count] : branchCounts)
+    {
+        if (count > 1)
+            problems.emplace_back("branch " + name + " appears " + std::to_string(count) + " times");
+    }
+
+    std::vector<std::pair<TLeaf *, TLeaf *>> arrays;
+    TObjArray *originalBranches = original->GetListOfBranches();
+    for (Int_t i = 0; i < originalBranches->GetEntriesFast(); ++i)
+    {
+        const std::string name = originalBranches->At(i)->GetName();
+        if (branchCounts.count(name) == 0)
+        {
+            problems.emplace_back("branch " + name + " is missing");
+            continue;
+        }
+        TLeaf *originalLeaf = original->GetLeaf(name.c_str());
+        if (!originalLeaf || !originalLeaf->GetLeafCount())
+            continue;
+        TLeaf *convertedLeaf = converted->GetLeaf(name.c_str());
+        if (!convertedLeaf || !convertedLeaf->GetLeafCount())
+        {
+            problems.emplace_back("branch " + name + " is not a variable size array");
+            continue;
+        }
+        arrays.emplace_back(originalLeaf, convertedLeaf);
+    }
+    if (!problems.empty() || arrays.empty())
+        return problems;
+
+    for (Long64_t entry = 0; entry < original->GetEntries(); ++entry)
+    {
+        original->GetEntry(entry);
+        converted->GetEntry(entry);
+        for (auto &[originalLeaf, convertedLeaf] : arrays)
+        {
+            bool same = originalLeaf->GetLen() == convertedLeaf->GetLen();
+            for (Int_t j = 0; same && j < originalLeaf->GetLen(); ++j)
+                same = originalLeaf->GetValue(j) == convertedLeaf->GetValue(j);
+            if (!same)
+            {
+                problems.emplace_back("branch " + std::string(originalLeaf->GetName()) + " differs in entry " +
+                                      std::to_string(entry));
+                return problems;
+            }
+        }
+    }
+    return problems;
+}
+
+/** Result of one benchmarked conversion */
+struct BenchResult
+{
+    std::string name;
+    long long events = 0;
+    long long inputBytes = 0;
+    double seconds = 0;
+};
+
+/** Quotes an argument for the shell */
+std::string Quote(const std::string &arg)
+{
+    std::string quoted = "'";
+    for (char c : arg)
+        quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    return quoted + "'";
+}
+
+/** Runs command repetitions times and returns the best wall time in seconds */
+double TimeCommand(const std::string &command, int repetitions)
+{
+    double best = 0;
+    for (int i = 0; i < repetitions; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (std::system(command.c_str()) != 0)
+        {
+            throw std::runtime_error("Command failed: " + command);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = i == 0 ? seconds : std::min(best, seconds);
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    std::string workDir = "./bench";
+    long long events = 1000000;
+    int columnsPerKind = 2;
+    std::vector<std::string> mix = {"scalar", "fixed", "var", "vector", "rvec"};
+    std::string layout = "both";
+    int arraySize = 8;
+    int repetitions = 3;
+    std::string toolsDir = std::filesystem::absolute(argv[0]).parent_path().string();
+    std::string root2parquetArgs;
+    std::string parquet2rootArgs;
+    std::string jsonFileName;
+    bool keepData = false;
+    bool check = false;
+
+    enum LongOnlyOptions
+    {
+        kRoot2ParquetArgs = 256,
+        kParquet2RootArgs,
+        kJson,
+        kKeepData,
+        kCheck
+    };
+    const struct option long_options[] = {
+        {"mix", required_argument, nullptr, 'm'},
+        {"layout", required_argument, nullptr, 'L'},
+        {"array-size", required_argument, nullptr, 'a'},
+        {"repetitions", required_argument, nullptr, 'r'},
+        {"tools-dir", required_argument, nullptr, 'd'},
+        {"root2parquet-args", required_argument, nullptr, kRoot2ParquetArgs},
+        {"parquet2root-args", required_argument, nullptr, kParquet2RootArgs},
+        {"json", required_argument, nullptr, kJson},
+        {"keep-data", no_argument, nullptr, kKeepData},
+        {"check", no_argument, nullptr, kCheck},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "o:n:c:m:L:a:r:d:h", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            workDir = optarg;
+            break;
+        case 'n':
+            events = std::stoll(optarg);
+            break;
+        case 'c':
+            columnsPerKind = std::stoi(optarg);
+            break;
+        case 'm':
+        {
+            mix.clear();
+            std::stringstream list(optarg);
+            std::string kind;
+            while (std::getline(list, kind, ','))
+            {
+                if (kind != "scalar" && kind != "fixed" && kind != "var" && kind != "vector" && kind != "rvec")
+                {
+                    std::cerr << "Error: unknown column kind " << kind << std::endl;
+                    return 1;
+                }
+                mix.emplace_back(kind);
+            }
+            break;
+        }
+        case 'L':
+            layout = optarg;
+            if (layout != "tall" && layout != "wide" && layout != "both")
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'a':
+            arraySize = std::stoi(optarg);
+            break;
+        case 'r':
+            repetitions = std::max(1, std::stoi(optarg));
+            break;
+        case 'd':
+            toolsDir = optarg;
+            break;
+        case kRoot2ParquetArgs:
+            root2parquetArgs = optarg;
+            break;
+        case kParquet2RootArgs:
+            parquet2rootArgs = optarg;
+            break;
+        case kJson:
+            jsonFileName = optarg;
+            break;
+        case kKeepData:
+            keepData = true;
+            break;
+        case kCheck:
+            check = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (mix.empty() || events <= 0 || columnsPerKind <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<DataSpec> specs;
+    if (layout != "wide")
+        specs.push_back({"tall", events, columnsPerKind, mix, arraySize});
+    if (layout != "tall")
+        specs.push_back({"wide", std::max(1LL, events / 32), columnsPerKind * 32, mix, arraySize});
+
+    const auto root2parquet = std::filesystem::path(toolsDir) / "root2parquet";
+    const auto parquet2root = std::filesystem::path(toolsDir) / "parquet2root";
+    std::vector<BenchResult> results;
+    int failedChecks = 0;
+    try
+    {
+        for (const auto &spec : specs)
+        {
+            // Generated files are named after their settings so that --keep-data never reuses other data
+            std::ostringstream tag;
+            tag << spec.layout << "_" << spec.events << "_" << spec.columnsPerKind << "_" << spec.arraySize;
+            for (const auto &kind : spec.mix)
+                tag << "_" << kind;
+            const auto dir = std::filesystem::path(workDir) / tag.str();
+            const auto rootInput = dir / "input.root";
+            const auto parquetInputDir = dir / "input_parquet";
+            const auto parquetInput = parquetInputDir / "input.parquet";
+            std::filesystem::create_directories(parquetInputDir);
+            if (!keepData || !std::filesystem::exists(rootInput) || !std::filesystem::exists(parquetInput))
+            {
+                std::cout << "Generating " << spec.layout << " data: " << spec.events << " events, "
+                          << spec.columnsPerKind * spec.mix.size() << " columns" << std::endl;
+                GenerateData(spec, rootInput.string(), parquetInput.string());
+            }
+
+            const auto parquetOutput = dir / "output.parquet";
+            const auto rootOutputDir = dir / "output_root";
+            const std::string quiet = " > " + Quote((dir / "log.txt").string()) + " 2>&1";
+            const std::string r2p = Quote(root2parquet.string()) + " -i " + Quote(rootInput.string()) + " -o " +
+                                    Quote(parquetOutput.string()) + " " + root2parquetArgs + quiet;
+            const std::string p2r = Quote(parquet2root.string()) + " -i " + Quote(parquetInputDir.string()) + " -o " +
+                                    Quote(rootOutputDir.string()) + " " + parquet2rootArgs + quiet;
+
+            std::cout << "Running root2parquet on " << spec.layout << " data" << std::endl;
+            results.push_back({spec.layout + " root2parquet", spec.events, (long long)std::filesystem::file_size(rootInput),
+                               TimeCommand(r2p, repetitions)});
+            std::cout << "Running parquet2root on " << spec.layout << " data" << std::endl;
+            results.push_back({spec.layout + " parquet2root", spec.events, (long long)std::filesystem::file_size(parquetInput),
+                               TimeCommand(p2r, repetitions)});
+
+            if (check)
+            {
+                // Parquet written by root2parquet keeps the n_name size branches as columns beside the arrays
+                const auto roundTripParquet = dir / "roundtrip_parquet";
+                const auto roundTripRoot = dir / "roundtrip_root";
+                std::filesystem::remove_all(roundTripParquet);
+                std::filesystem::remove_all(roundTripRoot);
+                TimeCommand(Quote(root2parquet.string()) + " -i " + Quote(rootInput.string()) + " -o " +
+                                Quote(roundTripParquet.string() + "/") + " " + root2parquetArgs + quiet,
+                            1);
+                TimeCommand(Quote(parquet2root.string()) + " -i " + Quote(roundTripParquet.string()) + " -o " +
+                                Quote(roundTripRoot.string()) + " " + parquet2rootArgs + quiet,
+                            1);
+                auto problems = CheckRoundTrip(rootInput.string(), (roundTripRoot / "input.root").string());
+                std::cout << "Round trip check of " << spec.layout << " data: " << (problems.empty() ? "passed" : "FAILED") << std::endl;
+                for (const auto &problem : problems)
+                    std::cout << "  " << problem << std::endl;
+                failedChecks += problems.empty() ? 0 : 1;
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << "\nBest of " << repetitions << " runs:\n";
+    std::printf("%-20s %12s %12s %10s %10s %14s\n", "conversion", "events", "input MB", "time s", "MB/s", "events/s");
+    for (const auto &r : results)
+    {
+        std::printf("%-20s %12lld %12.1f %10.3f %10.1f %14.0f\n", r.name.c_str(), r.events, r.inputBytes / 1e6, r.seconds,
+                    r.inputBytes / 1e6 / r.seconds, r.events / r.seconds);
+    }
+
+    if (!jsonFileName.empty())
+    {
+        std::ofstream json(jsonFileName);
+        json << "[";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const auto &r = results[i];
+            json << (i ? ",\n " : "") << "{\"name\": \"" << r.name << "\", \"events\": " << r.events << ", \"input_bytes\": " << r.inputBytes
+                 << ", \"seconds\": " << r.seconds << ", \"mb_per_s\": " << r.inputBytes / 1e6 / r.seconds
+                 << ", \"events_per_s\": " << r.events / r.seconds << "}";
+        }
+        json << "]" << std::endl;
+    }
+    return failedChecks > 0 ? 1 : 0;
+}
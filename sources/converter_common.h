@@ -0,0 +1,245 @@
+/**
+ * @file converter_common.h
+ * @brief Command line helpers and conversion statistics shared by root2parquet and parquet2root
+ *
+ */
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <optional>
+#include <regex>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <filesystem>
+#include <cstdint>
+
+/** Splits a comma separated list */
+inline std::vector<std::string> SplitList(const std::string &list)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (!item.empty())
+            items.emplace_back(item);
+    }
+    return items;
+}
+
+/** Selection of branches or columns given on the command line: include/exclude lists and regexes of names */
+struct NameSelection
+{
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    std::optional<std::regex> includeRegex;
+    std::optional<std::regex> excludeRegex;
+
+    /** A name is selected if it is included (or nothing is included explicitly) and not excluded */
+    bool Selects(const std::string &name) const
+    {
+        bool included = (include.empty() && !includeRegex) ||
+                        std::find(include.begin(), include.end(), name) != include.end() ||
+                        (includeRegex && std::regex_match(name, *includeRegex));
+        bool excluded = std::find(exclude.begin(), exclude.end(), name) != exclude.end() ||
+                        (excludeRegex && std::regex_match(name, *excludeRegex));
+        return included && !excluded;
+    }
+};
+
+/**
+ * Timers of the conversion phases, shared by all threads, and the reports of them
+ * Phase times are summed over the threads that spent them. Per-branch timers are only registered
+ * with --branch-timing, as they are taken for every entry. Each tool derives its statistics from this
+ * class, with its phases and the throughput counters it reports.
+ */
+class ConversionStatsBase
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    ConversionStatsBase(std::vector<std::string> phaseNames, bool branchTiming)
+        : phaseNames_(std::move(phaseNames)), phaseNanos_(phaseNames_.size()), branchTiming_(branchTiming), start_(Clock::now()) {}
+    virtual ~ConversionStatsBase() = default;
+
+    void Add(int phase, Clock::duration time) { AddNanos(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(time).count()); }
+    void AddNanos(int phase, int64_t nanos) { phaseNanos_[phase] += nanos; }
+
+    bool BranchTiming() const { return branchTiming_; }
+
+    /** Timer of a branch, shared by all threads converting it; nullptr without branch timing */
+    std::atomic<int64_t> *BranchTimer(const std::string &name)
+    {
+        if (!branchTiming_)
+            return nullptr;
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &timer = branchNanos_[name];
+        if (!timer)
+            timer = std::make_unique<std::atomic<int64_t>>(0);
+        return timer.get();
+    }
+
+    /** Human readable summary */
+    std::string Summary() const
+    {
+        const double elapsed = Elapsed();
+        std::ostringstream out;
+        out.precision(3);
+        out << std::fixed << "Conversion statistics after " << elapsed << " s:\n";
+        SummarizeCounters(out, elapsed);
+        out << "  thread time [s]:";
+        for (size_t phase = 0; phase < phaseNames_.size(); ++phase)
+            out << " " << phaseNames_[phase] << " " << PhaseSeconds(phase);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!branchNanos_.empty())
+        {
+            out << "\n  branch time [s]:";
+            for (const auto &[name, nanos] : branchNanos_)
+                out << " " << name << " " << *nanos / 1e9;
+        }
+        return out.str();
+    }
+
+    /** Summary as a JSON object */
+    std::string Json() const
+    {
+        std::ostringstream out;
+        out << "{\"elapsed_s\": " << Elapsed();
+        CountersJson(out);
+        out << ", \"phases_s\": {";
+        for (size_t phase = 0; phase < phaseNames_.size(); ++phase)
+            out << (phase ? ", " : "") << "\"" << phaseNames_[phase] << "\": " << PhaseSeconds(phase);
+        out << "}, \"branches_s\": {";
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = branchNanos_.begin(); it != branchNanos_.end(); ++it)
+            out << (it == branchNanos_.begin() ? "" : ", ") << "\"" << JsonEscape(it->first) << "\": " << *it->second / 1e9;
+        out << "}}";
+        return out.str();
+    }
+
+    /** Writes the JSON summary into fileName, replacing the previous one; nothing for an empty name */
+    void WriteJson(const std::string &fileName) const
+    {
+        if (fileName.empty())
+            return;
+        // Written beside and renamed so that readers never see a partial file
+        const std::string tmpName = fileName + ".tmp";
+        {
+            std::ofstream out(tmpName);
+            out << Json() << std::endl;
+            if (!out)
+            {
+                std::cerr << "Warning: failed to write stats to " << fileName << std::endl;
+                return;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(tmpName, fileName, error);
+        if (error)
+        {
+            std::cerr << "Warning: failed to write stats to " << fileName << ": " << error.message() << std::endl;
+        }
+    }
+
+protected:
+    /** Writes the counter lines of the summary, each indented by two spaces and ending with a newline */
+    virtual void SummarizeCounters(std::ostream &out, double elapsed) const = 0;
+    /** Writes the counters as JSON members, each preceded by ", " */
+    virtual void CountersJson(std::ostream &out) const = 0;
+    /** Time of a phase in seconds */
+    virtual double PhaseSeconds(int phase) const { return phaseNanos_[phase] / 1e9; }
+
+    int64_t PhaseNanos(int phase) const { return phaseNanos_[phase]; }
+
+private:
+    double Elapsed() const { return std::chrono::duration<double>(Clock::now() - start_).count(); }
+
+    static std::string JsonEscape(const std::string &s)
+    {
+        std::string escaped;
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    const std::vector<std::string> phaseNames_;
+    std::vector<std::atomic<int64_t>> phaseNanos_;
+    const bool branchTiming_;
+    const Clock::time_point start_;
+    mutable std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<std::atomic<int64_t>>> branchNanos_;
+};
+
+/** Adds the time spent in its scope to a phase, if stats are given */
+class PhaseTimer
+{
+public:
+    PhaseTimer(ConversionStatsBase *stats, int phase)
+        : stats_(stats), phase_(phase), start_(stats ? ConversionStatsBase::Clock::now() : ConversionStatsBase::Clock::time_point()) {}
+    ~PhaseTimer()
+    {
+        if (stats_)
+            stats_->Add(phase_, ConversionStatsBase::Clock::now() - start_);
+    }
+
+private:
+    ConversionStatsBase *stats_;
+    int phase_;
+    ConversionStatsBase::Clock::time_point start_;
+};
+
+/**
+ * Prints the stats summary and rewrites the JSON file, if given, every interval seconds until destroyed
+ * Without an interval nothing is reported
+ */
+class StatsReporter
+{
+public:
+    StatsReporter(const ConversionStatsBase &stats, double interval, const std::string &jsonFileName)
+        : stats_(stats), jsonFileName_(jsonFileName)
+    {
+        if (interval <= 0)
+            return;
+        thread_ = std::thread([this, interval]()
+                              {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!condition_.wait_for(lock, std::chrono::duration<double>(interval), [this] { return stop_; }))
+            {
+                std::cout << stats_.Summary() << std::endl;
+                stats_.WriteJson(jsonFileName_);
+            } });
+    }
+    ~StatsReporter()
+    {
+        if (!thread_.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        condition_.notify_all();
+        thread_.join();
+    }
+
+private:
+    const ConversionStatsBase &stats_;
+    std::string jsonFileName_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool stop_ = false;
+    std::thread thread_;
+};
@@ -0,0 +1,98 @@
+#pragma once
+// Conversion of Decimal128 arrays to the double and Long64_t values stored in ROOT branches
+
+#include <arrow/api.h>
+#include <Rtypes.h>
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// 10^exponent for the exponents of Decimal128 scales, computed once
+// Exact up to 10^22, the largest power of ten that is a double
+inline double PowerOfTen(int32_t exponent)
+{
+    static const std::array<double, 39> powers = []
+    {
+        std::array<double, 39> table{};
+        for (size_t i = 0; i < table.size(); ++i)
+            table[i] = std::pow(10.0, static_cast<double>(i));
+        return table;
+    }();
+    return powers.at(exponent);
+}
+
+// Converts the unscaled 128-bit integers of a Decimal128 array to the same doubles as std::stod of
+// their decimal strings, without formatting strings for the usual values:
+// when the unscaled integer is at most 2^53 and |scale| at most 22, both it and 10^|scale| are exact
+// doubles, so the one division (or multiplication) is the only rounding and gives the correctly
+// rounded result. Other values, with more than 15 digits or a larger scale, go through the string.
+// Null values are stored as 0
+inline void DecimalsToDouble(const arrow::Decimal128Array &array, std::vector<double> &out)
+{
+    constexpr uint64_t max_exact = uint64_t(1) << 53;
+    const int32_t scale = static_cast<const arrow::Decimal128Type &>(*array.type()).scale();
+    const bool exact_factor = std::abs(scale) <= 22;
+    const double factor = exact_factor ? PowerOfTen(std::abs(scale)) : 0.0;
+    const uint8_t *raw = array.raw_values();
+    out.resize(array.length());
+    for (int64_t i = 0; i < array.length(); ++i)
+    {
+        uint64_t low = 0;
+        int64_t high = 0;
+        std::memcpy(&low, raw + 16 * i, sizeof(low));
+        std::memcpy(&high, raw + 16 * i + 8, sizeof(high));
+        const bool negative = high < 0;
+        const uint64_t magnitude_low = negative ? ~low + 1 : low;
+        const bool small = negative ? (high == -1 && low != 0) : high == 0;
+        if (exact_factor && small && magnitude_low <= max_exact)
+        {
+            double unscaled = static_cast<double>(magnitude_low);
+            if (negative)
+                unscaled = -unscaled;
+            out[i] = scale >= 0 ? unscaled / factor : unscaled * factor;
+        }
+        else
+        {
+            out[i] = std::stod(arrow::Decimal128(raw + 16 * i).ToString(scale));
+        }
+    }
+    if (array.null_count() > 0)
+    {
+        for (int64_t i = 0; i < array.length(); ++i)
+        {
+            if (array.IsNull(i))
+                out[i] = 0.0;
+        }
+    }
+}
+
+// Copies the unscaled integers of a Decimal128 array, exact as long as they fit in 64 bits
+// Null values are stored as 0
+inline void DecimalsToScaled(const arrow::Decimal128Array &array, std::vector<Long64_t> &out)
+{
+    const uint8_t *raw = array.raw_values();
+    out.resize(array.length());
+    for (int64_t i = 0; i < array.length(); ++i)
+    {
+        uint64_t low = 0;
+        int64_t high = 0;
+        std::memcpy(&low, raw + 16 * i, sizeof(low));
+        std::memcpy(&high, raw + 16 * i + 8, sizeof(high));
+        if (array.IsNull(i))
+        {
+            out[i] = 0;
+            continue;
+        }
+        if (high != (static_cast<int64_t>(low) >> 63))
+        {
+            throw std::overflow_error("decimal value " + array.FormatValue(i) + " does not fit in Long64_t");
+        }
+        out[i] = static_cast<Long64_t>(low);
+    }
+}
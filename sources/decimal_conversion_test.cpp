@@ -0,0 +1,85 @@
+// Checks DecimalsToDouble against std::stod of the decimal strings, the correctly rounded reference,
+// for values around 2^53 and 2^64, the largest precisions and large positive and negative scales
+
+#include "decimal_conversion.h"
+#include <parquet/exception.h>
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+// Converts values with the given scale and compares every result with the reference; returns the mismatches
+int CheckScale(const std::vector<arrow::Decimal128> &values, int32_t scale)
+{
+    auto type = std::make_shared<arrow::Decimal128Type>(38, scale);
+    arrow::Decimal128Builder builder(type);
+    for (const auto &value : values)
+        PARQUET_THROW_NOT_OK(builder.Append(value));
+    PARQUET_THROW_NOT_OK(builder.AppendNull());
+    std::shared_ptr<arrow::Array> array;
+    PARQUET_THROW_NOT_OK(builder.Finish(&array));
+
+    std::vector<double> converted;
+    DecimalsToDouble(static_cast<const arrow::Decimal128Array &>(*array), converted);
+    int mismatches = 0;
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        const std::string text = values[i].ToString(scale);
+        const double expected = std::stod(text);
+        if (converted[i] != expected)
+        {
+            if (mismatches++ < 10)
+                std::cerr << std::setprecision(17) << "scale " << scale << ": " << text << " converted to " << converted[i] << " instead of "
+                          << expected << std::endl;
+        }
+    }
+    if (converted.back() != 0.0)
+    {
+        std::cerr << "scale " << scale << ": null converted to " << converted.back() << std::endl;
+        mismatches++;
+    }
+    return mismatches;
+}
+
+int main()
+{
+    std::vector<arrow::Decimal128> values;
+    auto add = [&](const arrow::Decimal128 &value)
+    {
+        values.push_back(value);
+        values.push_back(-value);
+    };
+    // Around 2^53, 2^64 and the largest 38 digit value
+    const arrow::Decimal128 two_53(int64_t(1) << 53);
+    const arrow::Decimal128 two_64(1, 0);
+    const arrow::Decimal128 max_38 = arrow::Decimal128::GetMaxValue(38);
+    for (int64_t delta = -1000; delta <= 1000; ++delta)
+    {
+        add(two_53 + arrow::Decimal128(delta));
+        add(two_64 + arrow::Decimal128(delta));
+        if (delta <= 0)
+            add(max_38 + arrow::Decimal128(delta));
+    }
+    // Small values, and random values of up to 38 digits
+    for (int64_t v = 0; v <= 1000; ++v)
+        add(arrow::Decimal128(v));
+    std::mt19937_64 rng(42);
+    for (int i = 0; i < 20000; ++i)
+    {
+        arrow::Decimal128 value(static_cast<int64_t>(rng() >> (rng() % 64)), rng());
+        if (arrow::Decimal128::Abs(value) <= max_38)
+            add(value);
+        add(arrow::Decimal128(static_cast<int64_t>(rng() >> (rng() % 64))));
+    }
+
+    int mismatches = 0;
+    for (int32_t scale : {0, 1, 2, 3, 6, 10, 15, 18, 21, 22, 23, 25, 30, 37, 38, -1, -5, -22, -23})
+        mismatches += CheckScale(values, scale);
+    if (mismatches > 0)
+    {
+        std::cerr << mismatches << " values differ from std::stod" << std::endl;
+        return 1;
+    }
+    std::cout << "All " << values.size() << " values match std::stod at every scale" << std::endl;
+    return 0;
+}
@@ -2,595 +2,2048 @@
 #include <arrow/io/api.h>
 #include <arrow/ipc/api.h>
 #include <parquet/arrow/reader.h>
+#include <parquet/file_reader.h>
+#include <parquet/arrow/schema.h>
+#include <parquet/metadata.h>
+#include <parquet/statistics.h>
 #include <TFile.h>
 #include <TTree.h>
+#include <TParameter.h>
 #include <TROOT.h>
+#include <Compression.h>
+#include <ROOT/TBufferMerger.hxx>
 #include <arrow/type.h>
 #include <arrow/type_fwd.h>
+#include <arrow/util/bit_util.h>
+#include <arrow/util/thread_pool.h>
+#include "decimal_conversion.h"
+#include "converter_common.h"
 #include <sstream>
 
 #include <iostream>
 #include <filesystem>
+#include <fstream>
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
 #include <memory>
 #include <thread>
-#include <queue>
+#include <deque>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
 #include <atomic>
 #include <stdexcept>
 #include <cstdint>
+#include <type_traits>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <optional>
+#include <regex>
 #include <unistd.h>
+#include <getopt.h>
 
-// Thread Pool for managing worker threads
+// Work-stealing thread pool for managing worker threads
+// Each worker owns a deque of tasks: it pops its own tasks from the back and steals from the
+// front of the other deques when it runs out, so enqueue and dequeue never share a global lock.
+// Tasks enqueued by a worker go to its own deque, tasks from other threads are spread round-robin.
+// Idle workers sleep and are woken one at a time, only when somebody is actually sleeping.
 class ThreadPool
 {
 private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
+    // tasks sitting in a deque, and tasks enqueued but not finished yet
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> sleeping{0};
+    std::atomic<size_t> next_queue{0};
     std::atomic<bool> stop{false};
-    std::atomic<size_t> active_tasks{0};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    static thread_local ThreadPool *current_pool;
+    static thread_local size_t current_worker;
+
+    bool pop_own(size_t self, std::function<void()> &task)
+    {
+        auto &q = *queues[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty())
+            return false;
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t self, std::function<void()> &task)
+    {
+        for (size_t k = 1; k <= queues.size(); ++k)
+        {
+            auto &q = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty())
+            {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Takes a task from the own deque of the calling worker, or steals one
+    bool take(std::function<void()> &task)
+    {
+        bool is_worker = current_pool == this;
+        size_t self = is_worker ? current_worker : 0;
+        if ((is_worker && pop_own(self, task)) || steal(self, task))
+        {
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void run(std::function<void()> &task)
+    {
+        task();
+        if (--pending == 0)
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            finished.notify_all();
+        }
+    }
 
-    void worker_thread()
+    void worker_thread(size_t index)
     {
+        current_pool = this;
+        current_worker = index;
         while (true)
         {
             std::function<void()> task;
+            if (take(task))
             {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                condition.wait(lock, [this]
-                               { return !tasks.empty() || stop; });
+                run(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleeping++;
+            wake.wait(lock, [this]
+                      { return queued > 0 || stop; });
+            sleeping--;
+            if (stop && queued == 0)
+                return;
+        }
+    }
+
+public:
+    ThreadPool(size_t num_threads = 0)
+    {
+        if (num_threads == 0)
+        {
+            num_threads = std::thread::hardware_concurrency();
+            if (num_threads == 0)
+                num_threads = 4;
+        }
+
+        std::cout << "Creating thread pool with " << num_threads << " threads" << std::endl;
+
+        for (size_t i = 0; i < num_threads; ++i)
+        {
+            queues.emplace_back(std::make_unique<WorkQueue>());
+        }
+        for (size_t i = 0; i < num_threads; ++i)
+        {
+            workers.emplace_back([this, i]()
+                                 { worker_thread(i); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+        {
+            if (worker.joinable())
+                worker.join();
+        }
+    }
+
+    size_t size() const { return workers.size(); }
+
+    void enqueue(std::function<void()> task)
+    {
+        pending++;
+        size_t target = current_pool == this ? current_worker : next_queue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[target]->mutex);
+            queues[target]->tasks.push_back(std::move(task));
+        }
+        queued++;
+        // A worker going to sleep registers in sleeping before it checks queued, so either it
+        // sees this task or we see it sleeping and wake it
+        if (sleeping > 0)
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            wake.notify_one();
+        }
+    }
+
+    // Queue of the sub-tasks of one waiting task, e.g. the column decodes of one file
+    // The sub-tasks are also scheduled on the pool, and whoever gets to one first runs it.
+    class TaskGroup
+    {
+        friend class ThreadPool;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<std::function<void()>> tasks;
 
-                if (stop && tasks.empty())
+        void run_one()
+        {
+            std::function<void()> task;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (tasks.empty())
                     return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+            std::lock_guard<std::mutex> lock(mutex);
+            changed.notify_all();
+        }
+    };
 
-                if (!tasks.empty())
-                {
-                    task = std::move(tasks.front());
-                    tasks.pop();
-                    active_tasks++;
-                }
+    void enqueue(const std::shared_ptr<TaskGroup> &group, std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(group->mutex);
+            group->tasks.push_back(std::move(task));
+        }
+        enqueue([group]()
+                { group->run_one(); });
+    }
+
+    // Runs the queued tasks of group on the calling thread until done() returns true, then
+    // sleeps until one of its tasks running elsewhere finishes
+    // Only tasks of the group are run: any other task, such as the conversion of another file,
+    // could take arbitrarily long and nest further conversions on the stack of the waiting one.
+    void help_until(TaskGroup &group, const std::function<bool()> &done)
+    {
+        std::unique_lock<std::mutex> lock(group.mutex);
+        while (!done())
+        {
+            if (group.tasks.empty())
+            {
+                group.changed.wait(lock);
+                continue;
             }
+            auto task = std::move(group.tasks.front());
+            group.tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    void wait_for_completion()
+    {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        finished.wait(lock, [this]
+                      { return pending == 0; });
+    }
+};
+
+thread_local ThreadPool *ThreadPool::current_pool = nullptr;
+thread_local size_t ThreadPool::current_worker = 0;
+
+// Record batch reader decoding the upcoming row groups of a file as pool tasks, one task per column,
+// while the caller converts the current one. Up to lookahead row groups are decoded ahead.
+// FileReader::RowGroup(i)->Column(j)->Read is the Arrow interface intended for this kind of parallelism.
+class ParallelRowGroupReader : public arrow::RecordBatchReader
+{
+private:
+    struct RowGroupDecode
+    {
+        std::vector<std::shared_ptr<arrow::ChunkedArray>> columns;
+        std::atomic<int> remaining{0};
+        std::mutex mutex;
+        arrow::Status status;
+    };
+
+    parquet::arrow::FileReader *file_reader;
+    ThreadPool &pool;
+    std::shared_ptr<ThreadPool::TaskGroup> tasks = std::make_shared<ThreadPool::TaskGroup>();
+    std::shared_ptr<arrow::Schema> schema_;
+    // Field index in the file of each column of schema_
+    std::vector<int> field_indices;
+    std::vector<int> row_groups;
+    int64_t batch_size;
+    int lookahead;
+    size_t next_row_group = 0;
+    std::deque<std::shared_ptr<RowGroupDecode>> decoding;
+    std::shared_ptr<arrow::Table> current;
+    std::unique_ptr<arrow::TableBatchReader> current_batches;
+
+    void schedule_next()
+    {
+        auto decode = std::make_shared<RowGroupDecode>();
+        int row_group = row_groups[next_row_group++];
+        int num_columns = schema_->num_fields();
+        decode->columns.resize(num_columns);
+        decode->remaining = num_columns;
+        for (int col = 0; col < num_columns; ++col)
+        {
+            auto *reader = file_reader;
+            int field_index = field_indices[col];
+            pool.enqueue(tasks, [reader, decode, row_group, col, field_index]()
+                         {
+                             auto status = reader->RowGroup(row_group)->Column(field_index)->Read(&decode->columns[col]);
+                             if (!status.ok())
+                             {
+                                 std::lock_guard<std::mutex> lock(decode->mutex);
+                                 decode->status = status;
+                             }
+                             decode->remaining--; });
+        }
+        decoding.push_back(decode);
+    }
+
+    void fill_lookahead()
+    {
+        while (static_cast<int>(decoding.size()) < lookahead + 1 && next_row_group < row_groups.size())
+        {
+            schedule_next();
+        }
+    }
+
+public:
+    ParallelRowGroupReader(parquet::arrow::FileReader *file_reader, ThreadPool &pool,
+                           std::shared_ptr<arrow::Schema> schema, std::vector<int> field_indices,
+                           std::vector<int> row_groups, int64_t batch_size, int lookahead)
+        : file_reader(file_reader), pool(pool), schema_(std::move(schema)), field_indices(std::move(field_indices)),
+          row_groups(std::move(row_groups)), batch_size(batch_size), lookahead(lookahead)
+    {
+        fill_lookahead();
+    }
+
+    ~ParallelRowGroupReader() override
+    {
+        // Pending tasks use the file reader, which is destroyed after this reader
+        for (auto &decode : decoding)
+        {
+            pool.help_until(*tasks, [&decode]
+                            { return decode->remaining == 0; });
+        }
+    }
 
-            if (task)
+    std::shared_ptr<arrow::Schema> schema() const override { return schema_; }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override
+    {
+        while (true)
+        {
+            if (current_batches)
+            {
+                ARROW_RETURN_NOT_OK(current_batches->ReadNext(batch));
+                if (*batch)
+                    return arrow::Status::OK();
+                current_batches.reset();
+                current.reset();
+            }
+            if (decoding.empty())
             {
-                task();
-                active_tasks--;
+                batch->reset();
+                return arrow::Status::OK();
+            }
 
-                bool has_more_work = false;
-                {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    if (!tasks.empty())
-                    {
-                        has_more_work = true;
-                    }
-                    else if (active_tasks == 0)
-                    {
-                        condition.notify_all();
-                    }
-                }
+            auto decode = decoding.front();
+            decoding.pop_front();
+            pool.help_until(*tasks, [&decode]
+                            { return decode->remaining == 0; });
+            ARROW_RETURN_NOT_OK(decode->status);
+            fill_lookahead();
+
+            current = arrow::Table::Make(schema_, decode->columns);
+            current_batches = std::make_unique<arrow::TableBatchReader>(*current);
+            if (batch_size > 0)
+                current_batches->set_chunksize(batch_size);
+        }
+    }
+};
 
-                if (has_more_work)
-                    continue;
+// Record batch reader running the reads of another reader on its own thread, up to depth batches
+// ahead, so that reading, decompressing and decoding the next batches overlaps with filling the tree.
+// A dedicated thread is used rather than a pool task, which could wait behind the task consuming it.
+class PrefetchingBatchReader : public arrow::RecordBatchReader
+{
+private:
+    std::shared_ptr<arrow::RecordBatchReader> source;
+    size_t depth;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable space;
+    std::deque<std::shared_ptr<arrow::RecordBatch>> queue;
+    // Status of the source after its last batch
+    arrow::Status status;
+    bool done = false;
+    bool stop = false;
+    // Started last, after the members it uses
+    std::thread thread;
+
+    void read_ahead()
+    {
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                space.wait(lock, [this]
+                           { return stop || queue.size() < depth; });
+                if (stop)
+                    return;
+            }
+            std::shared_ptr<arrow::RecordBatch> batch;
+            auto read_status = source->ReadNext(&batch);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!read_status.ok() || !batch)
+            {
+                status = read_status;
+                done = true;
+                ready.notify_one();
+                return;
             }
+            queue.push_back(std::move(batch));
+            ready.notify_one();
         }
     }
 
 public:
-    ThreadPool(size_t num_threads = 0)
+    PrefetchingBatchReader(std::shared_ptr<arrow::RecordBatchReader> source, size_t depth)
+        : source(std::move(source)), depth(std::max<size_t>(depth, 1)), thread([this]
+                                                                               { read_ahead(); })
+    {
+    }
+
+    ~PrefetchingBatchReader() override
     {
-        if (num_threads == 0)
         {
-            num_threads = std::thread::hardware_concurrency();
-            if (num_threads == 0)
-                num_threads = 4;
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        space.notify_one();
+        thread.join();
+    }
+
+    std::shared_ptr<arrow::Schema> schema() const override { return source->schema(); }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this]
+                   { return done || !queue.empty(); });
+        if (queue.empty())
+        {
+            batch->reset();
+            return status;
+        }
+        *batch = std::move(queue.front());
+        queue.pop_front();
+        space.notify_one();
+        return arrow::Status::OK();
+    }
+};
+
+// Appends the parquet leaf column indices of a schema field, as used by FileReader::ReadTable and
+// GetRecordBatchReader, so that the column chunks of unselected fields are never read
+void CollectLeafColumns(const parquet::arrow::SchemaField &field, std::vector<int> &leaves)
+{
+    if (field.is_leaf())
+    {
+        leaves.emplace_back(field.column_index);
+        return;
+    }
+    for (const auto &child : field.children)
+    {
+        CollectLeafColumns(child, leaves);
+    }
+}
+
+// Comparison operators of --where expressions
+enum class CompareOp
+{
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Equal,
+    NotEqual
+};
+
+// One comparison "column op number" of a --where expression
+struct Comparison
+{
+    std::string column;
+    CompareOp op = CompareOp::Equal;
+    double value = 0;
+};
+
+// Parses a --where expression: comparisons of a column with a number joined by &&,
+// e.g. "pt > 20 && charge == -1"
+std::vector<Comparison> ParseWhere(const std::string &expression)
+{
+    static const std::regex comparison_regex(R"(\s*([A-Za-z_][A-Za-z0-9_.]*)\s*(<=|>=|==|!=|<|>)\s*(\S+)\s*)");
+    static const std::map<std::string, CompareOp> ops = {
+        {"<", CompareOp::Less}, {"<=", CompareOp::LessEqual}, {">", CompareOp::Greater},
+        {">=", CompareOp::GreaterEqual}, {"==", CompareOp::Equal}, {"!=", CompareOp::NotEqual}};
+
+    std::vector<Comparison> comparisons;
+    size_t begin = 0;
+    while (begin <= expression.size())
+    {
+        size_t end = expression.find("&&", begin);
+        if (end == std::string::npos)
+            end = expression.size();
+        std::string term = expression.substr(begin, end - begin);
+        std::smatch match;
+        if (!std::regex_match(term, match, comparison_regex))
+        {
+            throw std::invalid_argument("cannot parse '" + term + "', expected [column] [<|<=|>|>=|==|!=] [number]");
+        }
+        Comparison comparison;
+        comparison.column = match[1];
+        comparison.op = ops.at(match[2]);
+        try
+        {
+            comparison.value = std::stod(match[3]);
+        }
+        catch (const std::exception &)
+        {
+            throw std::invalid_argument("not a number: " + std::string(match[3]));
+        }
+        comparisons.emplace_back(comparison);
+        begin = end + 2;
+    }
+    return comparisons;
+}
+
+// Min and max of a column chunk as doubles, if the chunk has statistics
+std::optional<std::pair<double, double>> ChunkMinMax(const parquet::ColumnChunkMetaData &chunk,
+                                                     const parquet::ColumnDescriptor &column)
+{
+    auto stats = chunk.statistics();
+    if (!stats || !stats->HasMinMax())
+        return std::nullopt;
+    const auto &logical = column.logical_type();
+    const bool is_unsigned = logical && logical->is_int() &&
+                             !static_cast<const parquet::IntLogicalType &>(*logical).is_signed();
+    switch (stats->physical_type())
+    {
+    case parquet::Type::BOOLEAN:
+    {
+        auto typed = std::static_pointer_cast<parquet::BoolStatistics>(stats);
+        return std::pair<double, double>(typed->min(), typed->max());
+    }
+    case parquet::Type::INT32:
+    {
+        auto typed = std::static_pointer_cast<parquet::Int32Statistics>(stats);
+        if (is_unsigned)
+            return std::pair<double, double>(static_cast<uint32_t>(typed->min()), static_cast<uint32_t>(typed->max()));
+        return std::pair<double, double>(typed->min(), typed->max());
+    }
+    case parquet::Type::INT64:
+    {
+        auto typed = std::static_pointer_cast<parquet::Int64Statistics>(stats);
+        if (is_unsigned)
+            return std::pair<double, double>(static_cast<uint64_t>(typed->min()), static_cast<uint64_t>(typed->max()));
+        return std::pair<double, double>(typed->min(), typed->max());
+    }
+    case parquet::Type::FLOAT:
+    {
+        auto typed = std::static_pointer_cast<parquet::FloatStatistics>(stats);
+        return std::pair<double, double>(typed->min(), typed->max());
+    }
+    case parquet::Type::DOUBLE:
+    {
+        auto typed = std::static_pointer_cast<parquet::DoubleStatistics>(stats);
+        return std::pair<double, double>(typed->min(), typed->max());
+    }
+    default:
+        return std::nullopt;
+    }
+}
+
+// Whether the min/max statistics of a column chunk allow values passing the comparison
+bool ChunkMayMatch(const parquet::ColumnChunkMetaData &chunk, const parquet::ColumnDescriptor &column,
+                   const Comparison &comparison)
+{
+    auto min_max = ChunkMinMax(chunk, column);
+    if (!min_max)
+        return true;
+    const auto [min, max] = *min_max;
+    const double value = comparison.value;
+    switch (comparison.op)
+    {
+    case CompareOp::Less:
+        return min < value;
+    case CompareOp::LessEqual:
+        return min <= value;
+    case CompareOp::Greater:
+        return max > value;
+    case CompareOp::GreaterEqual:
+        return max >= value;
+    case CompareOp::Equal:
+        return min <= value && value <= max;
+    case CompareOp::NotEqual:
+    {
+        // Float min/max leave out NaN, which is not equal to any value, so only integer chunks can be skipped
+        const bool floating = column.physical_type() == parquet::Type::FLOAT || column.physical_type() == parquet::Type::DOUBLE;
+        return floating || !(min == value && max == value);
+    }
+    }
+    return true;
+}
+
+// Row range and sampling given on the command line, in rows of each file
+struct RowRange
+{
+    int64_t first = 0;
+    // last row converted, -1: up to the end
+    int64_t last = -1;
+    // >= 1: every sample-th row from first, < 1: this fraction of the rows, evenly spaced
+    double sample = 1;
+
+    bool all() const { return first == 0 && last < 0 && sample == 1; }
+    bool overlaps(int64_t begin, int64_t end) const { return end > first && (last < 0 || begin <= last); }
+    bool selects(int64_t row) const
+    {
+        if (row < first || (last >= 0 && row > last))
+            return false;
+        if (sample >= 1)
+            return (row - first) % static_cast<int64_t>(sample) == 0;
+        return std::floor((row - first + 1) * sample) > std::floor((row - first) * sample);
+    }
+};
+
+// Conversion phases and throughput counters of parquet2root
+// Without --branch-timing, the row loop is not split into column fills and TTree::Fill, as that
+// takes timers for every row; TTree::Fill is then counted in the convert phase.
+class ConversionStats : public ConversionStatsBase
+{
+public:
+    enum Phase
+    {
+        kOpen,    // parquet metadata and schema, row group pruning, branch creation
+        kRead,    // reading, decompressing and decoding record batches (waiting for them with --row-group-tasks)
+        kFilter,  // --where evaluation
+        kConvert, // copying values into the branch buffers
+        kFill,    // TTree::Fill: basket serialization, compression and writes
+        kWrite,   // TTree::Write and closing the file
+        kNumPhases
+    };
+
+    explicit ConversionStats(bool branch_timing = false)
+        : ConversionStatsBase({"open", "read", "filter", "convert", "fill", "write"}, branch_timing) {}
+
+    std::atomic<int> files{0};
+    std::atomic<long long> rows_read{0};
+    std::atomic<long long> entries{0};
+    // Compressed size of the column chunks read, and size of the ROOT files written
+    std::atomic<long long> bytes_in{0};
+    std::atomic<long long> bytes_out{0};
+
+protected:
+    void SummarizeCounters(std::ostream &out, double elapsed) const override
+    {
+        const double mb_in = bytes_in / 1e6;
+        const double mb_out = bytes_out / 1e6;
+        out << "  files " << files << ", rows read " << rows_read << " (" << rows_read / elapsed << " /s), entries written "
+            << entries << " (" << entries / elapsed << " /s)\n"
+            << "  read " << mb_in << " MB (" << mb_in / elapsed << " MB/s), written " << mb_out << " MB (" << mb_out / elapsed << " MB/s)\n";
+    }
+
+    void CountersJson(std::ostream &out) const override
+    {
+        out << ", \"files\": " << files << ", \"rows_read\": " << rows_read << ", \"entries\": " << entries
+            << ", \"bytes_in\": " << bytes_in << ", \"bytes_out\": " << bytes_out;
+    }
+};
+
+// Thread budget of -t threads shared by the file conversions and Arrow's CPU thread pool
+// Every running conversion holds slots of the budget: one for its pool thread, or, when it decodes
+// its columns in parallel with Arrow's use_threads, the slots of the Arrow threads doing so. Arrow's
+// pool is resized to the slots held by such files, whose own pool threads mostly wait for Arrow, and
+// the other pool threads wait for a free slot before starting a file, so at most -t threads run.
+// In auto mode a file decodes in parallel when it is large: it gets one slot per share total_bytes / threads
+// of the input that it holds, so that it does not set the wall time, and when fewer files than free slots
+// are left, the last ones split the free slots between them instead of leaving cores idle.
+class ThreadBudget
+{
+public:
+    enum class Mode
+    {
+        kOff,
+        kOn,
+        kAuto
+    };
+
+    // Files smaller than this never decode in parallel, the tasks would cost more than they save
+    static constexpr int64_t kMinParallelBytes = 16LL * 1024 * 1024;
+
+    // Slots held by the conversion of the file at position in the schedule, given back on destruction
+    class Lease
+    {
+    public:
+        Lease(ThreadBudget &budget, size_t position, size_t slots, bool use_threads)
+            : budget(budget), position_(position), slots_(slots), use_threads_(use_threads) {}
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+        ~Lease() { budget.release(slots_, use_threads_); }
+        size_t position() const { return position_; }
+        bool use_arrow_threads() const { return use_threads_; }
+
+    private:
+        ThreadBudget &budget;
+        size_t position_;
+        size_t slots_;
+        bool use_threads_;
+    };
+
+    // file_bytes are the sizes of the files in the order they are started
+    ThreadBudget(Mode mode, size_t threads, std::vector<int64_t> file_bytes)
+        : mode(mode), threads(std::max<size_t>(threads, 1)), free_slots(this->threads), file_bytes(std::move(file_bytes))
+    {
+        const int64_t total_bytes = std::accumulate(this->file_bytes.begin(), this->file_bytes.end(), int64_t(0));
+        share_bytes = std::max<int64_t>(total_bytes / this->threads, 1);
+    }
+
+    // Waits for a free slot and starts the next file of the schedule
+    std::unique_ptr<Lease> start_next()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        freed.wait(lock, [this]
+                   { return free_slots > 0; });
+        const size_t position = next++;
+        const int64_t bytes = position < file_bytes.size() ? file_bytes[position] : 0;
+        const size_t unstarted = file_bytes.size() > position ? file_bytes.size() - position : 1;
+
+        bool use_threads = mode == Mode::kOn;
+        size_t slots = 1;
+        if (mode != Mode::kOff && (mode == Mode::kOn || bytes >= kMinParallelBytes))
+        {
+            size_t wanted = std::max<size_t>(static_cast<size_t>(bytes / share_bytes), free_slots / unstarted);
+            slots = std::clamp<size_t>(wanted, 1, free_slots);
+            use_threads = use_threads || slots > 1;
+        }
+        free_slots -= slots;
+        if (use_threads)
+            resize_arrow_pool(arrow_slots += slots);
+        return std::make_unique<Lease>(*this, position, slots, use_threads);
+    }
+
+private:
+    Mode mode;
+    size_t threads;
+    size_t free_slots;
+    std::vector<int64_t> file_bytes;
+    int64_t share_bytes = 1;
+    std::mutex mutex;
+    std::condition_variable freed;
+    size_t arrow_slots = 0;
+    size_t next = 0;
+
+    void release(size_t slots, bool use_threads)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_slots += slots;
+            if (use_threads && (arrow_slots -= slots) > 0)
+                resize_arrow_pool(arrow_slots);
+        }
+        freed.notify_all();
+    }
+
+    static void resize_arrow_pool(size_t capacity)
+    {
+        auto status = arrow::SetCpuThreadPoolCapacity(static_cast<int>(capacity));
+        if (!status.ok())
+            std::cerr << "Warning: failed to resize the Arrow thread pool: " << status.message() << std::endl;
+    }
+};
+
+// Parquet input settings given on the command line
+struct ParquetReadConfig
+{
+    // Map the file into memory instead of reading it through arrow::io::ReadableFile
+    bool memory_map = false;
+    // Pre-buffer the column chunks read, coalescing nearby ranges into few large reads
+    bool pre_buffer = false;
+    // arrow::io::CacheOptions of pre-buffering, 0: Arrow default
+    int64_t hole_size_limit = 0;
+    int64_t range_size_limit = 0;
+    // Merged ranges read ahead of the one being read, 0: none
+    int64_t prefetch_limit = 0;
+    // Read column chunks as buffered streams of this many bytes instead of whole, 0: off
+    int64_t buffer_size = 0;
+};
+
+// Helper struct for Arrow table data and metadata
+struct ParquetData
+{
+    // The file reader must outlive the record batch reader created from it
+    std::unique_ptr<parquet::arrow::FileReader> file_reader;
+    // Only set when the whole file is read at once (batch_size == 0)
+    std::shared_ptr<arrow::Table> table;
+    std::shared_ptr<arrow::RecordBatchReader> batches;
+    std::shared_ptr<arrow::Schema> schema;
+    std::map<int, arrow::Type::type> column_types;
+    int64_t num_rows = 0;
+    // Columns of schema written to ROOT; the others are only read for the where comparisons
+    std::vector<int> output_columns;
+    std::vector<Comparison> where;
+    RowRange rows;
+    // First row in the file and number of rows of the row groups read, in reading order
+    std::vector<std::pair<int64_t, int64_t>> read_row_groups;
+    int skipped_row_groups = 0;
+    // Compressed size of the column chunks read
+    int64_t read_bytes = 0;
+};
+
+// Opens a parquet file for reading. With a positive batch_size the row groups are streamed as
+// record batches of at most batch_size rows, so only one batch is resident at a time.
+// With batch_size == 0 the whole file is read into a table first.
+// With row_group_lookahead > 0, the next row groups are decoded column by column by tasks of thread_pool
+// while the current one is converted, holding up to row_group_lookahead + 1 row groups in memory.
+// The file is opened, buffered and pre-buffered as given by read_config. With use_threads, the columns
+// of the streamed or whole file reads are decoded in parallel on Arrow's CPU thread pool.
+// Only the columns chosen by selection and the columns of the where comparisons are read, and
+// row groups outside rows or whose statistics exclude the where comparisons are skipped.
+ParquetData OpenParquetFile(const std::string &parquet_filename, int64_t batch_size, const ParquetReadConfig &read_config,
+                            const NameSelection &selection,
+                            const std::vector<Comparison> &where, const RowRange &rows,
+                            ThreadPool *thread_pool = nullptr, int row_group_lookahead = 0, bool use_threads = false)
+{
+    ParquetData result;
+
+    try
+    {
+        arrow::MemoryPool *pool = arrow::default_memory_pool();
+
+        std::shared_ptr<arrow::io::RandomAccessFile> input;
+        if (read_config.memory_map)
+        {
+            auto status_input = arrow::io::MemoryMappedFile::Open(parquet_filename, arrow::io::FileMode::READ);
+            if (!status_input.ok())
+            {
+                throw std::runtime_error("Failed to map parquet file: " + status_input.status().message());
+            }
+            input = status_input.ValueOrDie();
+        }
+        else
+        {
+            auto status_input = arrow::io::ReadableFile::Open(parquet_filename);
+            if (!status_input.ok())
+            {
+                throw std::runtime_error("Failed to open parquet file: " + status_input.status().message());
+            }
+            input = status_input.ValueOrDie();
+        }
+
+        parquet::ArrowReaderProperties arrow_properties = parquet::default_arrow_reader_properties();
+        if (batch_size > 0)
+        {
+            arrow_properties.set_batch_size(batch_size);
+        }
+        // Row group tasks already decode the columns in parallel
+        arrow_properties.set_use_threads(use_threads && !(thread_pool && row_group_lookahead > 0));
+        if (read_config.pre_buffer)
+        {
+            arrow_properties.set_pre_buffer(true);
+            auto cache_options = arrow_properties.cache_options();
+            if (read_config.hole_size_limit > 0)
+                cache_options.hole_size_limit = read_config.hole_size_limit;
+            if (read_config.range_size_limit > 0)
+                cache_options.range_size_limit = read_config.range_size_limit;
+            cache_options.prefetch_limit = read_config.prefetch_limit;
+            arrow_properties.set_cache_options(cache_options);
+        }
+        parquet::ReaderProperties reader_properties = parquet::default_reader_properties();
+        if (read_config.buffer_size > 0)
+        {
+            reader_properties.enable_buffered_stream();
+            reader_properties.set_buffer_size(read_config.buffer_size);
+        }
+
+        parquet::arrow::FileReaderBuilder reader_builder;
+        reader_builder.memory_pool(pool);
+        reader_builder.properties(arrow_properties);
+
+        auto status_open = reader_builder.Open(input, reader_properties);
+        if (!status_open.ok())
+        {
+            throw std::runtime_error("Failed to open parquet reader: " + status_open.message());
+        }
+        auto status_build = reader_builder.Build();
+        if (!status_build.ok())
+        {
+            throw std::runtime_error("Failed to build parquet reader: " + status_build.status().message());
+        }
+        result.file_reader = std::move(status_build).ValueOrDie();
+        result.num_rows = result.file_reader->parquet_reader()->metadata()->num_rows();
+
+        // Only the column chunks of the selected fields are read
+        std::shared_ptr<arrow::Schema> file_schema;
+        auto status_schema = result.file_reader->GetSchema(&file_schema);
+        if (!status_schema.ok())
+        {
+            throw std::runtime_error("Failed to read schema: " + status_schema.message());
+        }
+        const auto &manifest = result.file_reader->manifest();
+        auto where_uses = [&where](const std::string &name)
+        {
+            return std::any_of(where.begin(), where.end(), [&name](const Comparison &c)
+                               { return c.column == name; });
+        };
+        std::vector<int> field_indices;
+        std::vector<int> leaf_columns;
+        arrow::FieldVector fields;
+        for (int i = 0; i < file_schema->num_fields(); ++i)
+        {
+            const bool selected = selection.Selects(file_schema->field(i)->name());
+            if (!selected && !where_uses(file_schema->field(i)->name()))
+                continue;
+            if (selected)
+                result.output_columns.emplace_back(fields.size());
+            field_indices.emplace_back(i);
+            fields.emplace_back(file_schema->field(i));
+            CollectLeafColumns(manifest.schema_fields[i], leaf_columns);
+        }
+        for (const auto &name : selection.include)
+        {
+            if (file_schema->GetFieldIndex(name) < 0)
+                std::cerr << "  Warning: column " << name << " not found in " << parquet_filename << std::endl;
+        }
+        if (result.output_columns.empty())
+        {
+            throw std::runtime_error("No columns selected");
+        }
+
+        // Row groups are skipped when they are outside rows or when the statistics of a where column
+        // exclude all of its rows
+        auto metadata = result.file_reader->parquet_reader()->metadata();
+        std::vector<int> row_groups;
+        int64_t row_group_start = 0;
+        for (int rg = 0; rg < result.file_reader->num_row_groups(); ++rg)
+        {
+            auto row_group = metadata->RowGroup(rg);
+            const int64_t start = row_group_start;
+            row_group_start += row_group->num_rows();
+            bool may_match = rows.overlaps(start, row_group_start);
+            for (const auto &comparison : where)
+            {
+                if (!may_match)
+                    break;
+                int field_index = file_schema->GetFieldIndex(comparison.column);
+                if (field_index < 0)
+                {
+                    throw std::runtime_error("Unknown column in where expression: " + comparison.column);
+                }
+                const auto &schema_field = manifest.schema_fields[field_index];
+                if (schema_field.is_leaf() &&
+                    !ChunkMayMatch(*row_group->ColumnChunk(schema_field.column_index),
+                                   *metadata->schema()->Column(schema_field.column_index), comparison))
+                {
+                    may_match = false;
+                    break;
+                }
+            }
+            if (may_match)
+            {
+                row_groups.emplace_back(rg);
+                result.read_row_groups.emplace_back(start, row_group->num_rows());
+                for (int column : leaf_columns)
+                    result.read_bytes += row_group->ColumnChunk(column)->total_compressed_size();
+            }
+            else
+            {
+                result.skipped_row_groups++;
+            }
+        }
+        result.where = where;
+        result.rows = rows;
+
+        if (thread_pool && row_group_lookahead > 0)
+        {
+            // Column reads of single row groups do not pre-buffer by themselves
+            if (read_config.pre_buffer && !row_groups.empty())
+            {
+                result.file_reader->parquet_reader()->PreBuffer(row_groups, leaf_columns, arrow_properties.io_context(),
+                                                                arrow_properties.cache_options());
+            }
+            result.batches = std::make_shared<ParallelRowGroupReader>(result.file_reader.get(), *thread_pool,
+                                                                      arrow::schema(fields), field_indices, row_groups,
+                                                                      batch_size, row_group_lookahead);
+        }
+        else if (batch_size > 0)
+        {
+            auto status_batches = result.file_reader->GetRecordBatchReader(row_groups, leaf_columns);
+            if (!status_batches.ok())
+            {
+                throw std::runtime_error("Failed to create record batch reader: " + status_batches.status().message());
+            }
+            result.batches = std::move(status_batches).ValueOrDie();
+        }
+        else
+        {
+            auto status_table = result.file_reader->ReadRowGroups(row_groups, leaf_columns);
+            if (!status_table.ok())
+            {
+                throw std::runtime_error("Failed to read table: " + status_table.status().message());
+            }
+            result.table = status_table.ValueOrDie();
+            result.batches = std::make_shared<arrow::TableBatchReader>(result.table);
+        }
+        result.schema = result.batches->schema();
+
+        for (int i = 0; i < result.schema->num_fields(); ++i)
+        {
+            result.column_types[i] = result.schema->field(i)->type()->id();
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error reading parquet file " << parquet_filename << ": " << e.what() << std::endl;
+        result.batches = nullptr;
+    }
+
+    return result;
+}
+
+// ROOT output file and tree settings given on the command line
+struct RootWriterConfig
+{
+    // empty: ROOT default compression settings
+    std::string compression;
+    int compression_level = -1;
+    // 0: TTree default basket size
+    int basket_size = 0;
+    // Passed to TTree::SetAutoFlush/SetAutoSave when non-zero:
+    // positive values are numbers of entries, negative values numbers of bytes
+    Long64_t auto_flush = 0;
+    Long64_t auto_save = 0;
+    // true: numeric lists as std::vector branches instead of variable length arrays
+    bool vector_lists = false;
+    // true: decimals as their unscaled Long64_t integers instead of doubles, the scale is in the tree user info
+    bool scaled_decimals = false;
+};
+
+// Options of a single parquet to ROOT conversion
+struct ConversionOptions
+{
+    int64_t batch_size = 65536;
+    // Row groups decoded ahead by column tasks of the thread pool (0: decode in the converting task)
+    int row_group_lookahead = 0;
+    // Record batches read ahead by a reader thread per file (0: read in the converting task)
+    int pipeline_depth = 0;
+    ParquetReadConfig input;
+    RootWriterConfig root;
+    NameSelection columns;
+    std::vector<Comparison> where;
+    RowRange rows;
+};
+
+// Returns the ROOT compression settings (algorithm * 100 + level) for an algorithm name
+int RootCompressionSettings(const std::string &algorithm, int level)
+{
+    using EAlgorithm = ROOT::RCompressionSetting::EAlgorithm;
+    if (algorithm == "none")
+        return 0;
+    // Default levels follow the ROOT presets (kUseGeneralPurpose, kUseSmallest, kUseAnalysis)
+    if (algorithm == "zlib")
+        return ROOT::CompressionSettings(EAlgorithm::kZLIB, level < 0 ? 1 : level);
+    if (algorithm == "lzma")
+        return ROOT::CompressionSettings(EAlgorithm::kLZMA, level < 0 ? 7 : level);
+    if (algorithm == "lz4")
+        return ROOT::CompressionSettings(EAlgorithm::kLZ4, level < 0 ? 4 : level);
+    if (algorithm == "zstd")
+        return ROOT::CompressionSettings(EAlgorithm::kZSTD, level < 0 ? 5 : level);
+    throw std::invalid_argument("Unknown ROOT compression algorithm: " + algorithm);
+}
+
+// Calls visitor with an Arrow type tag and the ROOT branch value type for numeric Arrow types
+// Returns false if the type is not numeric
+template <typename Visitor>
+bool VisitNumericType(arrow::Type::type id, Visitor &&visitor)
+{
+    switch (id)
+    {
+    case arrow::Type::FLOAT:
+        visitor(arrow::FloatType{}, float{});
+        return true;
+    case arrow::Type::DOUBLE:
+        visitor(arrow::DoubleType{}, double{});
+        return true;
+    case arrow::Type::INT8:
+        visitor(arrow::Int8Type{}, Char_t{});
+        return true;
+    case arrow::Type::UINT8:
+        visitor(arrow::UInt8Type{}, UChar_t{});
+        return true;
+    case arrow::Type::INT16:
+        visitor(arrow::Int16Type{}, int16_t{});
+        return true;
+    case arrow::Type::UINT16:
+        visitor(arrow::UInt16Type{}, uint16_t{});
+        return true;
+    case arrow::Type::INT32:
+        visitor(arrow::Int32Type{}, int{});
+        return true;
+    case arrow::Type::UINT32:
+        visitor(arrow::UInt32Type{}, uint32_t{});
+        return true;
+    case arrow::Type::INT64:
+        visitor(arrow::Int64Type{}, int64_t{});
+        return true;
+    case arrow::Type::UINT64:
+        visitor(arrow::UInt64Type{}, uint64_t{});
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Row filter of the --where comparisons, evaluated column by column on each record batch
+// Null values and non-numeric columns never pass
+class RowFilter
+{
+private:
+    std::vector<std::pair<int, Comparison>> comparisons;
+
+    template <typename T>
+    static void apply(const T *values, int64_t n, const Comparison &comparison, std::vector<char> &mask)
+    {
+        const double value = comparison.value;
+        switch (comparison.op)
+        {
+        case CompareOp::Less:
+            for (int64_t i = 0; i < n; ++i)
+                mask[i] &= static_cast<double>(values[i]) < value;
+            break;
+        case CompareOp::LessEqual:
+            for (int64_t i = 0; i < n; ++i)
+                mask[i] &= static_cast<double>(values[i]) <= value;
+            break;
+        case CompareOp::Greater:
+            for (int64_t i = 0; i < n; ++i)
+                mask[i] &= static_cast<double>(values[i]) > value;
+            break;
+        case CompareOp::GreaterEqual:
+            for (int64_t i = 0; i < n; ++i)
+                mask[i] &= static_cast<double>(values[i]) >= value;
+            break;
+        case CompareOp::Equal:
+            for (int64_t i = 0; i < n; ++i)
+                mask[i] &= static_cast<double>(values[i]) == value;
+            break;
+        case CompareOp::NotEqual:
+            for (int64_t i = 0; i < n; ++i)
+                mask[i] &= static_cast<double>(values[i]) != value;
+            break;
+        }
+    }
+
+public:
+    RowFilter(const std::vector<Comparison> &where, const arrow::Schema &schema)
+    {
+        for (const auto &comparison : where)
+        {
+            int col = schema.GetFieldIndex(comparison.column);
+            if (col < 0)
+            {
+                throw std::runtime_error("Unknown column in where expression: " + comparison.column);
+            }
+            auto id = schema.field(col)->type()->id();
+            if (id != arrow::Type::BOOL && !VisitNumericType(id, [](auto, auto) {}))
+            {
+                throw std::runtime_error("Column " + comparison.column + " in where expression is not a numeric scalar");
+            }
+            comparisons.emplace_back(col, comparison);
+        }
+    }
+
+    bool empty() const { return comparisons.empty(); }
+
+    // Sets mask[row] to 1 for the rows of batch passing every comparison, to 0 for the others
+    void evaluate(const arrow::RecordBatch &batch, std::vector<char> &mask) const
+    {
+        const int64_t n = batch.num_rows();
+        mask.assign(n, 1);
+        for (const auto &[col, comparison] : comparisons)
+        {
+            const arrow::Array &array = *batch.column(col);
+            if (array.type_id() == arrow::Type::BOOL)
+            {
+                const auto &bools = static_cast<const arrow::BooleanArray &>(array);
+                std::vector<uint8_t> values(n);
+                for (int64_t i = 0; i < n; ++i)
+                    values[i] = bools.Value(i);
+                apply(values.data(), n, comparison, mask);
+            }
+            else
+            {
+                VisitNumericType(array.type_id(), [&](auto arrow_type, auto)
+                                 {
+                                     using ArrowType = decltype(arrow_type);
+                                     apply(static_cast<const arrow::NumericArray<ArrowType> &>(array).raw_values(), n, comparison, mask); });
+            }
+            if (array.null_count() > 0)
+            {
+                for (int64_t i = 0; i < n; ++i)
+                {
+                    if (array.IsNull(i))
+                        mask[i] = 0;
+                }
+            }
+        }
+    }
+};
+
+// Fills the ROOT branch buffer of one column from the current record batch
+// The typed value pointers are resolved once per batch in bind(), so fill() is a plain store per row
+class ColumnFiller
+{
+public:
+    virtual ~ColumnFiller() = default;
+    virtual void bind(const arrow::Array &array) = 0;
+    virtual void fill(int64_t row) = 0;
+};
+
+template <typename ArrowType, typename RootType>
+class ScalarFiller : public ColumnFiller
+{
+private:
+    RootType value{};
+    const typename ArrowType::c_type *values = nullptr;
+
+public:
+    ScalarFiller(TTree &tree, const std::string &name) { tree.Branch(name.c_str(), &value); }
+    void bind(const arrow::Array &array) override
+    {
+        values = static_cast<const arrow::NumericArray<ArrowType> &>(array).raw_values();
+    }
+    void fill(int64_t row) override { value = values[row]; }
+};
+
+class BoolFiller : public ColumnFiller
+{
+private:
+    char value = 0;
+    const uint8_t *bits = nullptr;
+    int64_t offset = 0;
+
+public:
+    BoolFiller(TTree &tree, const std::string &name) { tree.Branch(name.c_str(), &value); }
+    void bind(const arrow::Array &array) override
+    {
+        bits = array.data()->GetValues<uint8_t>(1, 0);
+        offset = array.offset();
+    }
+    void fill(int64_t row) override { value = arrow::bit_util::GetBit(bits, offset + row) ? 1 : 0; }
+};
+
+class StringFiller : public ColumnFiller
+{
+private:
+    std::string value;
+    const arrow::StringArray *strings = nullptr;
+
+public:
+    StringFiller(TTree &tree, const std::string &name) { tree.Branch(name.c_str(), &value); }
+    void bind(const arrow::Array &array) override { strings = &static_cast<const arrow::StringArray &>(array); }
+    void fill(int64_t row) override
+    {
+        if (strings->IsNull(row))
+            value.clear();
+        else
+            value.assign(strings->GetView(row));
+    }
+};
+
+// Base of the fillers of LIST columns, stored in ROOT as std::vector
+// Null lists are stored as empty vectors
+template <typename RootType>
+class ListFiller : public ColumnFiller
+{
+protected:
+    std::vector<RootType> value;
+    const arrow::ListArray *list = nullptr;
+    const int32_t *offsets = nullptr;
+
+    virtual void bind_values(const arrow::Array &values) = 0;
+    virtual void fill_values(int64_t start, int64_t end) = 0;
+
+public:
+    ListFiller(TTree &tree, const std::string &name) { tree.Branch(name.c_str(), &value); }
+    void bind(const arrow::Array &array) override
+    {
+        list = &static_cast<const arrow::ListArray &>(array);
+        offsets = list->raw_value_offsets();
+        bind_values(*list->values());
+    }
+    void fill(int64_t row) override
+    {
+        value.clear();
+        if (list->IsNull(row))
+            return;
+        fill_values(offsets[row], offsets[row + 1]);
+    }
+};
+
+template <typename ArrowType, typename RootType>
+class NumericListFiller : public ListFiller<RootType>
+{
+private:
+    const typename ArrowType::c_type *values = nullptr;
+
+protected:
+    void bind_values(const arrow::Array &array) override
+    {
+        values = static_cast<const arrow::NumericArray<ArrowType> &>(array).raw_values();
+    }
+    void fill_values(int64_t start, int64_t end) override { this->value.assign(values + start, values + end); }
+
+public:
+    using ListFiller<RootType>::ListFiller;
+};
+
+// Leaf type code of a ROOT branch value type, as used in TTree::Branch leaf lists
+template <typename RootType>
+constexpr char LeafTypeCode()
+{
+    if constexpr (std::is_same_v<RootType, float>)
+        return 'F';
+    else if constexpr (std::is_same_v<RootType, double>)
+        return 'D';
+    else if constexpr (std::is_same_v<RootType, Char_t>)
+        return 'B';
+    else if constexpr (std::is_same_v<RootType, UChar_t>)
+        return 'b';
+    else if constexpr (std::is_same_v<RootType, int16_t>)
+        return 'S';
+    else if constexpr (std::is_same_v<RootType, uint16_t>)
+        return 's';
+    else if constexpr (std::is_same_v<RootType, int>)
+        return 'I';
+    else if constexpr (std::is_same_v<RootType, uint32_t>)
+        return 'i';
+    else if constexpr (std::is_same_v<RootType, int64_t>)
+        return 'L';
+    else
+    {
+        static_assert(std::is_same_v<RootType, uint64_t>, "no leaf type code for this type");
+        return 'l';
+    }
+}
+
+// Name of the count branch of the variable length array name: n_name, or n_name_1, n_name_2, ...
+// if a column of the file or a branch already in the tree has that name, e.g. the n_x column of
+// an x[n_x] tree converted by root2parquet
+std::string CountBranchName(TTree &tree, const std::string &name, const std::set<std::string> &column_names)
+{
+    const std::string base = "n_" + name;
+    std::string count_name = base;
+    for (int k = 1; column_names.count(count_name) || tree.GetBranch(count_name.c_str()); ++k)
+    {
+        count_name = base + "_" + std::to_string(k);
+    }
+    return count_name;
+}
+
+// Numeric lists stored as a variable length array name[count_name] with an Int_t count branch
+// The branch address points into the Arrow values buffer of the row, so nothing is copied per row
+template <typename ArrowType, typename RootType>
+class VarArrayFiller : public ColumnFiller
+{
+    static_assert(sizeof(RootType) == sizeof(typename ArrowType::c_type), "ROOT and Arrow value sizes differ");
+
+private:
+    Int_t count = 0;
+    RootType empty{};
+    TBranch *branch = nullptr;
+    const arrow::ListArray *list = nullptr;
+    const int32_t *offsets = nullptr;
+    RootType *values = nullptr;
+
+public:
+    VarArrayFiller(TTree &tree, const std::string &name, const std::string &count_name)
+    {
+        tree.Branch(count_name.c_str(), &count, (count_name + "/I").c_str());
+        const std::string leaf_list = name + "[" + count_name + "]/" + LeafTypeCode<RootType>();
+        branch = tree.Branch(name.c_str(), &empty, leaf_list.c_str());
+    }
+    void bind(const arrow::Array &array) override
+    {
+        list = &static_cast<const arrow::ListArray &>(array);
+        offsets = list->raw_value_offsets();
+        auto raw = static_cast<const arrow::NumericArray<ArrowType> &>(*list->values()).raw_values();
+        values = const_cast<RootType *>(reinterpret_cast<const RootType *>(raw));
+    }
+    void fill(int64_t row) override
+    {
+        count = list->IsNull(row) ? 0 : offsets[row + 1] - offsets[row];
+        branch->SetAddress(count > 0 ? values + offsets[row] : &empty);
+    }
+};
+
+class BoolListFiller : public ListFiller<char>
+{
+private:
+    const uint8_t *bits = nullptr;
+    int64_t offset = 0;
+
+protected:
+    void bind_values(const arrow::Array &array) override
+    {
+        bits = array.data()->GetValues<uint8_t>(1, 0);
+        offset = array.offset();
+    }
+    void fill_values(int64_t start, int64_t end) override
+    {
+        for (int64_t i = start; i < end; ++i)
+            value.push_back(arrow::bit_util::GetBit(bits, offset + i) ? 1 : 0);
+    }
+
+public:
+    using ListFiller<char>::ListFiller;
+};
+
+class StringListFiller : public ListFiller<std::string>
+{
+private:
+    const arrow::StringArray *strings = nullptr;
+
+protected:
+    void bind_values(const arrow::Array &array) override { strings = &static_cast<const arrow::StringArray &>(array); }
+    void fill_values(int64_t start, int64_t end) override
+    {
+        for (int64_t i = start; i < end; ++i)
+            value.push_back(strings->IsNull(i) ? std::string() : std::string(strings->GetView(i)));
+    }
+
+public:
+    using ListFiller<std::string>::ListFiller;
+};
+
+// Scalar decimal columns, such as decimal(21,10), as doubles or as unscaled Long64_t
+// The whole batch is converted in bind(), fill() only picks the row
+// Records the scale of a decimal column written as unscaled integers (--scaled-decimals) in the user info
+// of the tree, as TParameter<Int_t> "decimal_scale.[column]"; the titles of branch and leaf are left as ROOT sets them
+void RecordDecimalScale(TTree &tree, const std::string &name, int32_t scale)
+{
+    tree.GetUserInfo()->Add(new TParameter<Int_t>(("decimal_scale." + name).c_str(), scale));
+}
+
+template <typename RootType>
+class DecimalFiller : public ColumnFiller
+{
+private:
+    RootType value{};
+    std::vector<RootType> converted;
+
+public:
+    DecimalFiller(TTree &tree, const std::string &name, int32_t scale)
+    {
+        tree.Branch(name.c_str(), &value);
+        if constexpr (std::is_same_v<RootType, Long64_t>)
+            RecordDecimalScale(tree, name, scale);
+    }
+    void bind(const arrow::Array &array) override
+    {
+        const auto &decimals = static_cast<const arrow::Decimal128Array &>(array);
+        if constexpr (std::is_same_v<RootType, double>)
+            DecimalsToDouble(decimals, converted);
+        else
+            DecimalsToScaled(decimals, converted);
+    }
+    void fill(int64_t row) override { value = converted[row]; }
+};
+
+template <typename RootType>
+class DecimalListFiller : public ListFiller<RootType>
+{
+private:
+    std::vector<RootType> converted;
+
+protected:
+    void bind_values(const arrow::Array &array) override
+    {
+        const auto &decimals = static_cast<const arrow::Decimal128Array &>(array);
+        if constexpr (std::is_same_v<RootType, double>)
+            DecimalsToDouble(decimals, converted);
+        else
+            DecimalsToScaled(decimals, converted);
+    }
+    void fill_values(int64_t start, int64_t end) override
+    {
+        this->value.assign(converted.begin() + start, converted.begin() + end);
+    }
+
+public:
+    DecimalListFiller(TTree &tree, const std::string &name, int32_t scale) : ListFiller<RootType>(tree, name)
+    {
+        if constexpr (std::is_same_v<RootType, Long64_t>)
+            RecordDecimalScale(tree, name, scale);
+    }
+};
+
+// Creates the branch and the filler of a column, or returns nullptr for unsupported types
+// Numeric lists are written as variable length arrays unless config.vector_lists is set;
+// column_names are the names of all columns written to tree, which count branches must not take
+std::unique_ptr<ColumnFiller> MakeFiller(TTree &tree, const arrow::Field &field, const RootWriterConfig &config,
+                                         const std::set<std::string> &column_names)
+{
+    const std::string &col_name = field.name();
+    std::unique_ptr<ColumnFiller> filler;
+
+    if (field.type()->id() == arrow::Type::LIST)
+    {
+        auto value_type = std::static_pointer_cast<arrow::ListType>(field.type())->value_type();
+        switch (value_type->id())
+        {
+        case arrow::Type::BOOL:
+            filler = std::make_unique<BoolListFiller>(tree, col_name);
+            break;
+        case arrow::Type::STRING:
+            filler = std::make_unique<StringListFiller>(tree, col_name);
+            break;
+        case arrow::Type::DECIMAL128:
+        {
+            const int32_t scale = std::static_pointer_cast<arrow::Decimal128Type>(value_type)->scale();
+            if (config.scaled_decimals)
+                filler = std::make_unique<DecimalListFiller<Long64_t>>(tree, col_name, scale);
+            else
+                filler = std::make_unique<DecimalListFiller<double>>(tree, col_name, scale);
+            break;
+        }
+        default:
+            VisitNumericType(value_type->id(), [&](auto arrow_type, auto root_value)
+                             {
+                                 using ArrowType = decltype(arrow_type);
+                                 using RootType = decltype(root_value);
+                                 if (config.vector_lists)
+                                     filler = std::make_unique<NumericListFiller<ArrowType, RootType>>(tree, col_name);
+                                 else
+                                     filler = std::make_unique<VarArrayFiller<ArrowType, RootType>>(
+                                         tree, col_name, CountBranchName(tree, col_name, column_names));
+                             });
+            break;
         }
-
-        std::cout << "Creating thread pool with " << num_threads << " threads" << std::endl;
-
-        for (size_t i = 0; i < num_threads; ++i)
+        if (!filler)
         {
-            workers.emplace_back([this]()
-                                 { worker_thread(); });
+            std::cerr << "Unsupported list element type for column "
+                      << col_name << " : " << value_type->ToString() << std::endl;
         }
+        return filler;
     }
 
-    ~ThreadPool()
+    switch (field.type()->id())
     {
-        stop = true;
-        condition.notify_all();
-        for (auto &worker : workers)
-        {
-            if (worker.joinable())
-                worker.join();
-        }
-    }
-
-    void enqueue(std::function<void()> task)
+    case arrow::Type::BOOL:
+        filler = std::make_unique<BoolFiller>(tree, col_name);
+        break;
+    case arrow::Type::STRING:
+        filler = std::make_unique<StringFiller>(tree, col_name);
+        break;
+    case arrow::Type::DECIMAL128:
     {
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            tasks.push(std::move(task));
-        }
-        condition.notify_all();
+        const int32_t scale = std::static_pointer_cast<arrow::Decimal128Type>(field.type())->scale();
+        if (config.scaled_decimals)
+            filler = std::make_unique<DecimalFiller<Long64_t>>(tree, col_name, scale);
+        else
+            filler = std::make_unique<DecimalFiller<double>>(tree, col_name, scale);
+        break;
     }
-
-    void wait_for_completion()
+    default:
+        VisitNumericType(field.type()->id(), [&](auto arrow_type, auto root_value)
+                         { filler = std::make_unique<ScalarFiller<decltype(arrow_type), decltype(root_value)>>(tree, col_name); });
+        break;
+    }
+    if (!filler)
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        condition.wait(lock, [this]
-                       { return tasks.empty() && active_tasks == 0; });
+        std::cerr << "Unsupported scalar type for column "
+                  << col_name << " : " << field.type()->ToString() << std::endl;
     }
-};
-
-// Helper struct for Arrow table data and metadata
-struct ParquetData
-{
-    std::shared_ptr<arrow::Table> table;
-    std::map<int, arrow::Type::type> column_types;
-};
+    return filler;
+}
 
-ParquetData ReadParquetFile(const std::string &parquet_filename)
+// Creates the branches of the selected columns in tree and fills it with the selected rows of parquet_data
+// Returns the number of entries filled; phase times and counters are added to stats if given
+Long64_t FillTree(TTree &tree, const ParquetData &parquet_data, const RootWriterConfig &config, ConversionStats *stats)
 {
-    ParquetData result;
+    auto &schema = parquet_data.schema;
+    std::optional<PhaseTimer> open_timer(std::in_place, stats, ConversionStats::kOpen);
+
+    // Branches and fill kernels are planned once per file
+    std::set<std::string> column_names;
+    for (int col : parquet_data.output_columns)
+        column_names.insert(schema->field(col)->name());
+    std::vector<std::pair<int, std::unique_ptr<ColumnFiller>>> fillers;
+    for (int col : parquet_data.output_columns)
+    {
+        auto filler = MakeFiller(tree, *schema->field(col), config, column_names);
+        if (filler)
+            fillers.emplace_back(col, std::move(filler));
+    }
 
-    try
+    if (config.basket_size > 0)
     {
-        arrow::MemoryPool *pool = arrow::default_memory_pool();
+        tree.SetBasketSize("*", config.basket_size);
+    }
 
-        auto status_input = arrow::io::ReadableFile::Open(parquet_filename);
-        if (!status_input.ok())
+    // With branch timing, every column fill and TTree::Fill is timed, summed per batch
+    const bool timed = stats && stats->BranchTiming();
+    std::vector<std::atomic<int64_t> *> column_timers;
+    for (auto &[col, filler] : fillers)
+        column_timers.emplace_back(timed ? stats->BranchTimer(schema->field(col)->name()) : nullptr);
+    std::vector<int64_t> column_nanos(fillers.size());
+    auto nanos_since = [](ConversionStats::Clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(ConversionStats::Clock::now() - start).count();
+    };
+
+    RowFilter filter(parquet_data.where, *schema);
+    std::vector<char> mask;
+    const RowRange &rows = parquet_data.rows;
+
+    // Row number in the file of the next row read, which skips the row groups left out
+    const auto &read_row_groups = parquet_data.read_row_groups;
+    size_t read_group = 0;
+    int64_t group_row = 0;
+    auto next_file_row = [&]()
+    {
+        while (group_row >= read_row_groups[read_group].second)
         {
-            throw std::runtime_error("Failed to open parquet file: " + status_input.status().message());
+            ++read_group;
+            group_row = 0;
         }
-        std::shared_ptr<arrow::io::RandomAccessFile> input = status_input.ValueOrDie();
-
-        parquet::arrow::FileReaderBuilder reader_builder;
-        reader_builder.memory_pool(pool);
+        return read_row_groups[read_group].first + group_row++;
+    };
+    open_timer.reset();
+
+    // Walk the input batch by batch. Each batch lies within a single chunk of every
+    // column, so multi row group files are read in full.
+    // Filled entries are counted here: in merge mode the tree is reset after every part it auto-saves
+    Long64_t entries = 0;
+    std::shared_ptr<arrow::RecordBatch> batch;
+    while (true)
+    {
+        {
+            PhaseTimer timer(stats, ConversionStats::kRead);
+            auto status_batch = parquet_data.batches->ReadNext(&batch);
+            if (!status_batch.ok())
+            {
+                throw std::runtime_error("Failed to read record batch: " + status_batch.message());
+            }
+        }
+        if (!batch)
+            break;
 
-        auto status_open = reader_builder.Open(input);
-        if (!status_open.ok())
+        if (!filter.empty())
         {
-            throw std::runtime_error("Failed to open parquet reader: " + status_open.message());
+            PhaseTimer timer(stats, ConversionStats::kFilter);
+            filter.evaluate(*batch, mask);
         }
-        auto status_build = reader_builder.Build();
-        if (!status_build.ok())
+        auto batch_start = ConversionStats::Clock::now();
+        int64_t fill_nanos = 0;
+        for (auto &[col, filler] : fillers)
         {
-            throw std::runtime_error("Failed to build parquet reader: " + status_build.status().message());
+            filler->bind(*batch->column(col));
         }
-        std::unique_ptr<parquet::arrow::FileReader> arrow_reader = std::move(status_build).ValueOrDie();
-
-        auto status_table = arrow_reader->ReadTable(&result.table);
-        if (!status_table.ok())
+        for (int64_t row = 0; row < batch->num_rows(); ++row)
         {
-            throw std::runtime_error("Failed to read table: " + status_table.message());
+            if (!rows.all() && !rows.selects(next_file_row()))
+                continue;
+            if (!filter.empty() && !mask[row])
+                continue;
+            if (!timed)
+            {
+                for (auto &entry : fillers)
+                {
+                    entry.second->fill(row);
+                }
+                tree.Fill();
+                entries++;
+                continue;
+            }
+            for (size_t i = 0; i < fillers.size(); ++i)
+            {
+                auto start = ConversionStats::Clock::now();
+                fillers[i].second->fill(row);
+                column_nanos[i] += nanos_since(start);
+            }
+            auto start = ConversionStats::Clock::now();
+            tree.Fill();
+            fill_nanos += nanos_since(start);
+            entries++;
         }
-
-        for (int i = 0; i < result.table->num_columns(); ++i)
+        if (stats)
         {
-            result.column_types[i] = result.table->column(i)->type()->id();
+            stats->rows_read += batch->num_rows();
+            stats->AddNanos(ConversionStats::kConvert, nanos_since(batch_start) - fill_nanos);
+            stats->AddNanos(ConversionStats::kFill, fill_nanos);
+            for (size_t i = 0; timed && i < fillers.size(); ++i)
+            {
+                *column_timers[i] += column_nanos[i];
+                column_nanos[i] = 0;
+            }
         }
     }
-    catch (const std::exception &e)
+
+    if (stats)
     {
-        std::cerr << "Error reading parquet file " << parquet_filename << ": " << e.what() << std::endl;
-        result.table = nullptr;
+        stats->files++;
+        stats->entries += entries;
+        stats->bytes_in += parquet_data.read_bytes;
     }
+    return entries;
+}
 
-    return result;
+// Prints the end of the conversion of a file, with the numbers of selected rows and skipped row groups
+void PrintConversionComplete(const std::string &target, const ParquetData &parquet_data, Long64_t entries)
+{
+    std::cout << "  Conversion complete: " << target;
+    if (!parquet_data.where.empty() || !parquet_data.rows.all())
+        std::cout << " (" << entries << " of " << parquet_data.num_rows << " rows selected, "
+                  << parquet_data.skipped_row_groups << " row groups skipped)";
+    std::cout << std::endl;
 }
 
 // NOTE: global ROOT mutex removed for testing
-void WriteRootFile(const std::string &root_filename, const ParquetData &parquet_data)
+// Phase times and counters are added to stats if given
+void WriteRootFile(const std::string &root_filename, const ParquetData &parquet_data, const RootWriterConfig &config,
+                   ConversionStats *stats = nullptr)
 {
-    if (!parquet_data.table)
+    if (!parquet_data.batches)
     {
-        std::cerr << "Error: Null table provided to WriteRootFile" << std::endl;
+        std::cerr << "Error: Null record batch reader provided to WriteRootFile" << std::endl;
         return;
     }
 
     try
     {
+        std::optional<PhaseTimer> open_timer(std::in_place, stats, ConversionStats::kOpen);
         TFile root_file(root_filename.c_str(), "RECREATE");
         if (root_file.IsZombie())
         {
             throw std::runtime_error("Failed to create ROOT file");
         }
+        if (!config.compression.empty())
+        {
+            root_file.SetCompressionSettings(RootCompressionSettings(config.compression, config.compression_level));
+        }
 
         TTree tree("tree", "Converted Parquet Data");
+        if (config.auto_flush != 0)
+            tree.SetAutoFlush(config.auto_flush);
+        if (config.auto_save != 0)
+            tree.SetAutoSave(config.auto_save);
+        open_timer.reset();
 
-        auto &table = parquet_data.table;
-        auto &column_types = parquet_data.column_types;
-
-        std::vector<float> float_columns(table->num_columns());
-        std::vector<double> double_columns(table->num_columns());
-        std::vector<int> int_columns(table->num_columns());
-        std::vector<int16_t> short_columns(table->num_columns());
-        std::vector<uint64_t> ull_columns(table->num_columns());
-        std::vector<int64_t> ll_columns(table->num_columns());
-        std::vector<uint32_t> uint_columns(table->num_columns());
-        std::vector<uint16_t> ushort_columns(table->num_columns());
-        std::vector<char> bool_columns(table->num_columns());
-        std::vector<std::string> string_columns(table->num_columns());
-
-        struct ArrayColumn
-        {
-            arrow::Type::type element_type;
-            std::vector<float> float_array;
-            std::vector<double> double_array;
-            std::vector<int> int_array;
-            std::vector<int16_t> short_array;
-            std::vector<uint64_t> ull_array;
-            std::vector<int64_t> ll_array;
-            std::vector<uint32_t> uint_array;
-            std::vector<uint16_t> ushort_array;
-            std::vector<char> bool_array;
-            std::vector<std::string> string_array;
-            // for decimal arrays such as decimal(21,10), stored in ROOT as doubles
-            int32_t decimal_scale = 0;
-            int32_t decimal_precision = 0;
-        };
-
-        std::map<int, ArrayColumn> array_columns;
-
-        for (int col = 0; col < table->num_columns(); ++col)
+        const Long64_t entries = FillTree(tree, parquet_data, config, stats);
         {
-            std::string col_name = table->schema()->field(col)->name();
-            auto col_type = column_types.at(col);
+            PhaseTimer timer(stats, ConversionStats::kWrite);
+            tree.Write();
+            root_file.Close();
+        }
+        if (stats)
+            stats->bytes_out += std::filesystem::file_size(root_filename);
+        PrintConversionComplete(root_filename, parquet_data, entries);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error writing ROOT file " << root_filename << ": " << e.what() << std::endl;
+    }
+}
 
-            if (col_type == arrow::Type::LIST)
-            {
-                auto list_type = std::static_pointer_cast<arrow::ListType>(table->column(col)->type());
-                auto value_type = list_type->value_type();
-                auto element_type = value_type->id();
+// Output of merge mode: the trees converted from all files are merged into one ROOT file by ROOT::TBufferMerger.
+// Every conversion fills its tree in a TBufferMergerFile of its own, which is merged when it is written.
+// With ordered, the files are merged in input order, and a file finished before its predecessors is kept
+// in memory until they are written. Without, a tree may also be merged in parts as it auto-saves.
+class MergedRootOutput
+{
+private:
+    ROOT::TBufferMerger merger;
+    bool ordered;
+    std::mutex mutex;
+    // Finished files waiting for their predecessors, by input index
+    std::map<size_t, std::shared_ptr<ROOT::TBufferMergerFile>> pending;
+    size_t next_index = 0;
 
-                ArrayColumn arr_col;
-                arr_col.element_type = element_type;
+public:
+    MergedRootOutput(const std::string &filename, const RootWriterConfig &config, bool ordered)
+        : merger(filename.c_str(), "RECREATE",
+                 config.compression.empty() ? static_cast<int>(ROOT::RCompressionSetting::EDefaults::kUseCompiledDefault)
+                                            : RootCompressionSettings(config.compression, config.compression_level)),
+          ordered(ordered)
+    {
+    }
 
-                switch (element_type)
-                {
-                case arrow::Type::FLOAT:
-                    tree.Branch(col_name.c_str(), &arr_col.float_array);
-                    break;
-                case arrow::Type::DOUBLE:
-                    tree.Branch(col_name.c_str(), &arr_col.double_array);
-                    break;
-                case arrow::Type::INT32:
-                    tree.Branch(col_name.c_str(), &arr_col.int_array);
-                    break;
-                case arrow::Type::INT16:
-                    tree.Branch(col_name.c_str(), &arr_col.short_array);
-                    break;
-                case arrow::Type::UINT64:
-                    tree.Branch(col_name.c_str(), &arr_col.ull_array);
-                    break;
-                case arrow::Type::INT64:
-                    tree.Branch(col_name.c_str(), &arr_col.ll_array);
-                    break;
-                case arrow::Type::UINT32:
-                    tree.Branch(col_name.c_str(), &arr_col.uint_array);
-                    break;
-                case arrow::Type::UINT16:
-                    tree.Branch(col_name.c_str(), &arr_col.ushort_array);
-                    break;
-                case arrow::Type::BOOL:
-                    tree.Branch(col_name.c_str(), &arr_col.bool_array);
-                    break;
-                case arrow::Type::STRING:
-                    tree.Branch(col_name.c_str(), &arr_col.string_array);
-                    break;
-                case arrow::Type::DECIMAL128:
-                {
-                    auto dec_type = std::static_pointer_cast<arrow::Decimal128Type>(value_type);
-                    arr_col.decimal_scale = dec_type->scale();
-                    arr_col.decimal_precision = dec_type->precision();
+    bool is_ordered() const { return ordered; }
 
-                    // store decimal array in ROOT as vector<double>
-                    tree.Branch(col_name.c_str(), &arr_col.double_array);
-                    break;
-                }
-                default:
-                    std::cerr << "Unsupported list element type for column "
-                              << col_name << " : " << value_type->ToString() << std::endl;
-                    break;
-                }
+    std::shared_ptr<ROOT::TBufferMergerFile> open_file() { return merger.GetFile(); }
 
-                array_columns[col] = std::move(arr_col);
-            }
-            else
-            {
-                switch (col_type)
-                {
-                case arrow::Type::FLOAT:
-                    tree.Branch(col_name.c_str(), &float_columns[col]);
-                    break;
-                case arrow::Type::DOUBLE:
-                    tree.Branch(col_name.c_str(), &double_columns[col]);
-                    break;
-                case arrow::Type::INT32:
-                    tree.Branch(col_name.c_str(), &int_columns[col]);
-                    break;
-                case arrow::Type::INT16:
-                    tree.Branch(col_name.c_str(), &short_columns[col]);
-                    break;
-                case arrow::Type::UINT64:
-                    tree.Branch(col_name.c_str(), &ull_columns[col]);
-                    break;
-                case arrow::Type::INT64:
-                    tree.Branch(col_name.c_str(), &ll_columns[col]);
-                    break;
-                case arrow::Type::UINT32:
-                    tree.Branch(col_name.c_str(), &uint_columns[col]);
-                    break;
-                case arrow::Type::UINT16:
-                    tree.Branch(col_name.c_str(), &ushort_columns[col]);
-                    break;
-                case arrow::Type::BOOL:
-                    tree.Branch(col_name.c_str(), &bool_columns[col]);
-                    break;
-                case arrow::Type::STRING:
-                    tree.Branch(col_name.c_str(), &string_columns[col]);
-                    break;
-                default:
-                    std::cerr << "Unsupported scalar type for column "
-                              << col_name << " : "
-                              << table->column(col)->type()->ToString() << std::endl;
-                    break;
-                }
-            }
+    // Hands the file converted from input index to the merger. Every index has to be written,
+    // with a null file for a failed conversion, so that ordered output does not wait for it forever.
+    void write(size_t index, std::shared_ptr<ROOT::TBufferMergerFile> file)
+    {
+        if (!ordered)
+        {
+            if (file)
+                file->Write();
+            return;
         }
-
-        for (int64_t row = 0; row < table->num_rows(); ++row)
+        std::lock_guard<std::mutex> lock(mutex);
+        pending[index] = std::move(file);
+        for (auto it = pending.begin(); it != pending.end() && it->first == next_index; it = pending.erase(it), ++next_index)
         {
-            for (int col = 0; col < table->num_columns(); ++col)
-            {
-                auto col_type = column_types.at(col);
+            if (it->second)
+                it->second->Write();
+        }
+    }
+};
 
-                if (col_type == arrow::Type::LIST)
-                {
-                    auto list_array = std::static_pointer_cast<arrow::ListArray>(table->column(col)->chunk(0));
-                    auto &arr_col = array_columns[col];
-
-                    arr_col.float_array.clear();
-                    arr_col.double_array.clear();
-                    arr_col.int_array.clear();
-                    arr_col.short_array.clear();
-                    arr_col.ull_array.clear();
-                    arr_col.ll_array.clear();
-                    arr_col.uint_array.clear();
-                    arr_col.ushort_array.clear();
-                    arr_col.bool_array.clear();
-                    arr_col.string_array.clear();
-
-                    if (list_array->IsNull(row))
-                        continue;
-
-                    auto values = list_array->values();
-                    int64_t start = list_array->value_offset(row);
-                    int64_t end = list_array->value_offset(row + 1);
-
-                    switch (arr_col.element_type)
-                    {
-                    case arrow::Type::FLOAT:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::FloatArray>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.float_array.push_back(arr->Value(i));
-                        break;
-                    }
-                    case arrow::Type::DOUBLE:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::DoubleArray>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.double_array.push_back(arr->Value(i));
-                        break;
-                    }
-                    case arrow::Type::INT32:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::Int32Array>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.int_array.push_back(arr->Value(i));
-                        break;
-                    }
-                    case arrow::Type::INT16:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::Int16Array>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.short_array.push_back(arr->Value(i));
-                        break;
-                    }
-                    case arrow::Type::UINT64:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::UInt64Array>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.ull_array.push_back(arr->Value(i));
-                        break;
-                    }
-                    case arrow::Type::INT64:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::Int64Array>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.ll_array.push_back(arr->Value(i));
-                        break;
-                    }
-                    case arrow::Type::UINT32:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::UInt32Array>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.uint_array.push_back(arr->Value(i));
-                        break;
-                    }
-                    case arrow::Type::UINT16:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::UInt16Array>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.ushort_array.push_back(arr->Value(i));
-                        break;
-                    }
-                    case arrow::Type::BOOL:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::BooleanArray>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.bool_array.push_back(arr->Value(i) ? 1 : 0);
-                        break;
-                    }
-                    case arrow::Type::STRING:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::StringArray>(values);
-                        for (int64_t i = start; i < end; ++i)
-                            arr_col.string_array.push_back(arr->IsNull(i) ? std::string() : arr->GetString(i));
-                        break;
-                    }
-                    case arrow::Type::DECIMAL128:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::Decimal128Array>(values);
-
-                        for (int64_t i = start; i < end; ++i)
-                        {
-                            if (arr->IsNull(i))
-                            {
-                                arr_col.double_array.push_back(0.0);
-                            }
-                            else
-                            {
-                                std::string s = arr->FormatValue(i);
-                                arr_col.double_array.push_back(std::stod(s));
-                            }
-                        }
-                        break;
-                    }
-                    default:
-                        break;
-                    }
-                }
-                else
-                {
-                    switch (col_type)
-                    {
-                    case arrow::Type::FLOAT:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::FloatArray>(table->column(col)->chunk(0));
-                        float_columns[col] = arr->Value(row);
-                        break;
-                    }
-                    case arrow::Type::DOUBLE:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::DoubleArray>(table->column(col)->chunk(0));
-                        double_columns[col] = arr->Value(row);
-                        break;
-                    }
-                    case arrow::Type::INT32:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::Int32Array>(table->column(col)->chunk(0));
-                        int_columns[col] = arr->Value(row);
-                        break;
-                    }
-                    case arrow::Type::INT16:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::Int16Array>(table->column(col)->chunk(0));
-                        short_columns[col] = arr->Value(row);
-                        break;
-                    }
-                    case arrow::Type::UINT64:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::UInt64Array>(table->column(col)->chunk(0));
-                        ull_columns[col] = arr->Value(row);
-                        break;
-                    }
-                    case arrow::Type::INT64:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::Int64Array>(table->column(col)->chunk(0));
-                        ll_columns[col] = arr->Value(row);
-                        break;
-                    }
-                    case arrow::Type::UINT32:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::UInt32Array>(table->column(col)->chunk(0));
-                        uint_columns[col] = arr->Value(row);
-                        break;
-                    }
-                    case arrow::Type::UINT16:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::UInt16Array>(table->column(col)->chunk(0));
-                        ushort_columns[col] = arr->Value(row);
-                        break;
-                    }
-                    case arrow::Type::BOOL:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::BooleanArray>(table->column(col)->chunk(0));
-                        bool_columns[col] = arr->Value(row) ? 1 : 0;
-                        break;
-                    }
-                    case arrow::Type::STRING:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::StringArray>(table->column(col)->chunk(0));
-                        string_columns[col] = arr->IsNull(row) ? std::string() : arr->GetString(row);
-                        break;
-                    }
-                    case arrow::Type::DECIMAL128:
-                    {
-                        auto arr = std::static_pointer_cast<arrow::Decimal128Array>(table->column(col)->chunk(0));
-                        double_columns[col] = arr->IsNull(row) ? 0.0 : std::stod(arr->FormatValue(row));
-                        break;
-                    }
-                    default:
-                        break;
-                    }
-                }
-            }
+// Opens a parquet file for a conversion with options; batches is null if it cannot be read
+// With use_threads, its columns are decoded in parallel on Arrow's CPU thread pool
+ParquetData OpenForConversion(const std::string &parquet_filename, const ConversionOptions &options, ThreadPool *pool,
+                              ConversionStats *stats, bool use_threads)
+{
+    std::cout << "Reading: " << parquet_filename << (use_threads ? " (parallel column decoding)" : "") << std::endl;
 
-            tree.Fill();
-        }
+    std::optional<PhaseTimer> open_timer(std::in_place, stats, ConversionStats::kOpen);
+    ParquetData parquet_data = OpenParquetFile(parquet_filename, options.batch_size, options.input, options.columns, options.where,
+                                               options.rows, pool, options.row_group_lookahead, use_threads);
+    open_timer.reset();
+
+    if (!parquet_data.batches)
+    {
+        std::cerr << "Skipping file due to read failure: " << parquet_filename << std::endl;
+        return parquet_data;
+    }
+    // A whole file read at once has nothing left to overlap with
+    if (options.pipeline_depth > 0 && !parquet_data.table)
+    {
+        parquet_data.batches = std::make_shared<PrefetchingBatchReader>(parquet_data.batches, options.pipeline_depth);
+    }
 
-        tree.Write();
-        root_file.Close();
+    std::cout << "  Opened " << parquet_data.num_rows
+              << " rows, " << parquet_data.schema->num_fields()
+              << " columns" << std::endl;
+    return parquet_data;
+}
 
-        std::cout << "  Conversion complete: " << root_filename << std::endl;
+void ConvertSingleParquetToRoot(const std::string &parquet_filename, const std::string &root_filename,
+                                const ConversionOptions &options, ThreadPool *pool = nullptr, ConversionStats *stats = nullptr,
+                                bool use_threads = false)
+{
+    try
+    {
+        ParquetData parquet_data = OpenForConversion(parquet_filename, options, pool, stats, use_threads);
+        if (parquet_data.batches)
+            WriteRootFile(root_filename, parquet_data, options.root, stats);
     }
     catch (const std::exception &e)
     {
-        std::cerr << "Error writing ROOT file " << root_filename << ": " << e.what() << std::endl;
+        std::cerr << "Error processing " << parquet_filename << ": " << e.what() << std::endl;
     }
 }
 
-void ConvertSingleParquetToRoot(const std::string &parquet_filename, const std::string &root_filename)
+// Converts the file with input index into a TBufferMergerFile of merged
+void MergeParquetIntoRoot(const std::string &parquet_filename, size_t index, MergedRootOutput &merged,
+                          const ConversionOptions &options, ThreadPool *pool = nullptr, ConversionStats *stats = nullptr,
+                          bool use_threads = false)
 {
+    std::shared_ptr<ROOT::TBufferMergerFile> file;
     try
     {
-        std::cout << "Reading: " << parquet_filename << std::endl;
-
-        ParquetData parquet_data = ReadParquetFile(parquet_filename);
-
-        if (!parquet_data.table)
+        ParquetData parquet_data = OpenForConversion(parquet_filename, options, pool, stats, use_threads);
+        if (parquet_data.batches)
         {
-            std::cerr << "Skipping file due to read failure: " << parquet_filename << std::endl;
-            return;
+            file = merged.open_file();
+            file->cd();
+            // Owned and written by the file
+            auto *tree = new TTree("tree", "Converted Parquet Data");
+            if (options.root.auto_flush != 0)
+                tree->SetAutoFlush(options.root.auto_flush);
+            // An auto-save would hand a part of the tree to the merger ahead of the preceding files
+            if (merged.is_ordered())
+                tree->SetAutoSave(0);
+            else if (options.root.auto_save != 0)
+                tree->SetAutoSave(options.root.auto_save);
+
+            const Long64_t entries = FillTree(*tree, parquet_data, options.root, stats);
+            PrintConversionComplete(parquet_filename, parquet_data, entries);
         }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error processing " << parquet_filename << ": " << e.what() << std::endl;
+        // A partly filled tree is not merged
+        file.reset();
+    }
+    {
+        PhaseTimer timer(stats, ConversionStats::kWrite);
+        merged.write(index, std::move(file));
+    }
+}
 
-        std::cout << "  Read " << parquet_data.table->num_rows()
-                  << " rows, " << parquet_data.table->num_columns()
-                  << " columns" << std::endl;
+// A parquet file of the input dataset, with the row count and compressed size of its row groups
+struct DatasetFile
+{
+    std::string path;
+    // Path relative to the input directory, mirrored in the output directory
+    std::filesystem::path relative;
+    int64_t rows = 0;
+    int64_t bytes = 0;
+};
 
-        WriteRootFile(root_filename, parquet_data);
+// Row counts and sizes of the files listed in the _metadata summary file of a dataset directory, by path
+void ReadSummaryMetadata(const std::filesystem::path &summary, std::map<std::string, std::pair<int64_t, int64_t>> &sizes)
+{
+    try
+    {
+        std::shared_ptr<arrow::io::ReadableFile> input;
+        PARQUET_ASSIGN_OR_THROW(input, arrow::io::ReadableFile::Open(summary.string()));
+        auto metadata = parquet::ReadMetaData(input);
+        for (int rg = 0; rg < metadata->num_row_groups(); ++rg)
+        {
+            auto row_group = metadata->RowGroup(rg);
+            if (row_group->num_columns() == 0 || row_group->ColumnChunk(0)->file_path().empty())
+                continue;
+            auto &size = sizes[(summary.parent_path() / row_group->ColumnChunk(0)->file_path()).lexically_normal().string()];
+            size.first += row_group->num_rows();
+            size.second += row_group->total_compressed_size();
+        }
     }
     catch (const std::exception &e)
     {
-        std::cerr << "Error processing " << parquet_filename << ": " << e.what() << std::endl;
+        std::cerr << "  Warning: ignoring summary file " << summary.string() << ": " << e.what() << std::endl;
+    }
+}
+
+// Finds the .parquet files under input_dir, also in subdirectories such as Hive partitions key=value.
+// Files and directories starting with _ or . (_metadata, _SUCCESS, _temporary, ...) are not data.
+// The row counts and sizes come from a _metadata summary file when it lists the file, else from its footer.
+// The files are returned in path order.
+std::vector<DatasetFile> DiscoverDataset(const std::string &input_dir)
+{
+    auto hidden = [](const std::filesystem::path &path)
+    {
+        const std::string name = path.filename().string();
+        return !name.empty() && (name[0] == '_' || name[0] == '.');
+    };
+    std::vector<DatasetFile> files;
+    std::map<std::string, std::pair<int64_t, int64_t>> summary_sizes;
+    for (auto it = std::filesystem::recursive_directory_iterator(input_dir); it != std::filesystem::recursive_directory_iterator(); ++it)
+    {
+        const auto &path = it->path();
+        if (it->is_directory() && hidden(path))
+        {
+            it.disable_recursion_pending();
+            continue;
+        }
+        if (!it->is_regular_file())
+            continue;
+        if (path.filename() == "_metadata")
+            ReadSummaryMetadata(path, summary_sizes);
+        else if (!hidden(path) && path.extension() == ".parquet")
+            files.push_back({path.lexically_normal().string(), std::filesystem::relative(path, input_dir)});
+    }
+    std::sort(files.begin(), files.end(), [](const DatasetFile &a, const DatasetFile &b)
+              { return a.path < b.path; });
+
+    for (auto &file : files)
+    {
+        auto summary = summary_sizes.find(file.path);
+        if (summary != summary_sizes.end())
+        {
+            file.rows = summary->second.first;
+            file.bytes = summary->second.second;
+            continue;
+        }
+        try
+        {
+            std::shared_ptr<arrow::io::ReadableFile> input;
+            PARQUET_ASSIGN_OR_THROW(input, arrow::io::ReadableFile::Open(file.path));
+            auto metadata = parquet::ReadMetaData(input);
+            file.rows = metadata->num_rows();
+            for (int rg = 0; rg < metadata->num_row_groups(); ++rg)
+                file.bytes += metadata->RowGroup(rg)->total_compressed_size();
+        }
+        catch (const std::exception &e)
+        {
+            // The conversion reports the error; schedule the file by its size meanwhile, or as empty if that fails too
+            std::error_code error;
+            const auto size = std::filesystem::file_size(file.path, error);
+            file.bytes = error ? 0 : static_cast<int64_t>(size);
+        }
     }
+    return files;
 }
 
 void usage(char *argv0)
 {
     std::cout << "[parquet2root]: Usage:\n"
               << argv0 << " -i [input_parquet_directory] -o [output_directory] [-t num_threads]\n"
-              << "  -i: input directory containing parquet files (required)\n"
-              << "  -o: output directory for root files (will be created if not exists)\n"
-              << "  -t: number of threads (default: auto-detect CPU cores)"
+              << "  -i: input directory containing parquet files, also in subdirectories such as key=value partitions (required)\n"
+              << "  -o: output directory for root files, mirroring the input directory (will be created if not exists)\n"
+              << "  -t: number of threads (default: auto-detect CPU cores)\n"
+              << "  -b: rows per record batch read at a time (default: 65536, 0: read whole files)\n"
+              << "  -c, --compression [none|zlib|lzma|lz4|zstd]: ROOT output compression (default: ROOT default)\n"
+              << "  -l, --compression-level [level]: compression level (default: ROOT preset of the algorithm)\n"
+              << "  --basket-size [bytes]: basket size of every branch (default: TTree default)\n"
+              << "  --auto-flush [n]: TTree::SetAutoFlush, entries if positive, bytes if negative\n"
+              << "  --auto-save [n]: TTree::SetAutoSave, entries if positive, bytes if negative\n"
+              << "  --row-group-tasks [n]: row groups decoded ahead by column tasks shared with idle threads (default: 0)\n"
+              << "  --pipeline-depth [n]: record batches read ahead by a reader thread per file while the tree is filled (default: 0)\n"
+              << "  --root-imt [n]: enable ROOT implicit MT with n threads (0: ROOT default) to compress baskets in parallel\n"
+              << "  --merge [file.root]: merge the trees of all files into one ROOT file with TBufferMerger instead of -o\n"
+              << "  --merge-ordered: merge the files in input (file name) order instead of as they finish\n"
+              << "  --mmap: memory map the input files\n"
+              << "  --pre-buffer: pre-buffer the column chunks read, coalescing nearby ranges into large reads\n"
+              << "  --cache-hole-size [bytes], --cache-range-size [bytes]: largest gap merged and largest merged read\n"
+              << "      of --pre-buffer (default: Arrow defaults, 8 KiB and 32 MiB)\n"
+              << "  --cache-prefetch [n]: merged ranges of --pre-buffer read ahead of the one being decoded (default: 0)\n"
+              << "  --buffer-size [bytes]: read column chunks as buffered streams of this size instead of whole (default: off)\n"
+              << "  --arrow-threads [auto|on|off]: decode the columns of a file in parallel on Arrow's thread pool; auto: for\n"
+              << "      files larger than their share of the input, or when fewer files than threads are left (default: auto)\n"
+              << "  --vector-lists: write numeric lists as std::vector branches instead of arrays name[n_name]\n"
+              << "  --scaled-decimals: write decimals as unscaled Long64_t integers instead of doubles\n"
+              << "  --include [col,...], --exclude [col,...]: columns to convert / to skip (default: all)\n"
+              << "  --include-regex [regex], --exclude-regex [regex]: the same for column names fully matching regex\n"
+              << "  --where [expression]: convert only rows passing comparisons of numeric columns with numbers\n"
+              << "      joined by &&, e.g. \"pt > 20 && charge == -1\"; row groups excluded by the statistics are not read\n"
+              << "  --first [row] --last [row]: convert only the rows first to last of each file (default: all)\n"
+              << "  --sample [n|fraction]: convert every n-th row, or the given fraction of the rows evenly spaced\n"
+              << "  --stats-json [file]: write the conversion statistics as JSON at exit (and with every periodic report)\n"
+              << "  --stats-interval [seconds]: print the conversion statistics periodically (default: 0, at exit only)\n"
+              << "  --branch-timing: measure the time of every column and of TTree::Fill (adds timer calls per row)"
               << std::endl;
 }
 
@@ -605,9 +2058,83 @@ int main(int argc, char *argv[])
     std::string input_dir = "";
     std::string output_dir = "./output_root_files";
     size_t num_threads = 0;
+    ConversionOptions options;
+    std::string stats_json;
+    double stats_interval = 0;
+    bool branch_timing = false;
+    // ROOT implicit multi-threading pool size, -1: disabled, 0: ROOT default
+    int root_imt = -1;
+    // Merge mode output file, empty: one ROOT file per parquet file
+    std::string merge_filename;
+    bool merge_ordered = false;
+    ThreadBudget::Mode arrow_threads = ThreadBudget::Mode::kAuto;
+
+    enum LongOnlyOptions
+    {
+        kBasketSize = 256,
+        kAutoFlush,
+        kAutoSave,
+        kRowGroupTasks,
+        kVectorLists,
+        kScaledDecimals,
+        kInclude,
+        kExclude,
+        kIncludeRegex,
+        kExcludeRegex,
+        kWhere,
+        kFirst,
+        kLast,
+        kSample,
+        kStatsJson,
+        kStatsInterval,
+        kBranchTiming,
+        kPipelineDepth,
+        kRootImt,
+        kMerge,
+        kMergeOrdered,
+        kMmap,
+        kPreBuffer,
+        kCacheHoleSize,
+        kCacheRangeSize,
+        kCachePrefetch,
+        kBufferSize,
+        kArrowThreads
+    };
+    const struct option long_options[] = {
+        {"compression", required_argument, nullptr, 'c'},
+        {"compression-level", required_argument, nullptr, 'l'},
+        {"basket-size", required_argument, nullptr, kBasketSize},
+        {"auto-flush", required_argument, nullptr, kAutoFlush},
+        {"auto-save", required_argument, nullptr, kAutoSave},
+        {"row-group-tasks", required_argument, nullptr, kRowGroupTasks},
+        {"vector-lists", no_argument, nullptr, kVectorLists},
+        {"scaled-decimals", no_argument, nullptr, kScaledDecimals},
+        {"include", required_argument, nullptr, kInclude},
+        {"exclude", required_argument, nullptr, kExclude},
+        {"include-regex", required_argument, nullptr, kIncludeRegex},
+        {"exclude-regex", required_argument, nullptr, kExcludeRegex},
+        {"where", required_argument, nullptr, kWhere},
+        {"first", required_argument, nullptr, kFirst},
+        {"last", required_argument, nullptr, kLast},
+        {"sample", required_argument, nullptr, kSample},
+        {"stats-json", required_argument, nullptr, kStatsJson},
+        {"stats-interval", required_argument, nullptr, kStatsInterval},
+        {"branch-timing", no_argument, nullptr, kBranchTiming},
+        {"pipeline-depth", required_argument, nullptr, kPipelineDepth},
+        {"root-imt", required_argument, nullptr, kRootImt},
+        {"merge", required_argument, nullptr, kMerge},
+        {"merge-ordered", no_argument, nullptr, kMergeOrdered},
+        {"mmap", no_argument, nullptr, kMmap},
+        {"pre-buffer", no_argument, nullptr, kPreBuffer},
+        {"cache-hole-size", required_argument, nullptr, kCacheHoleSize},
+        {"cache-range-size", required_argument, nullptr, kCacheRangeSize},
+        {"cache-prefetch", required_argument, nullptr, kCachePrefetch},
+        {"buffer-size", required_argument, nullptr, kBufferSize},
+        {"arrow-threads", required_argument, nullptr, kArrowThreads},
+        {nullptr, 0, nullptr, 0}};
 
     int opt = 0;
-    while ((opt = getopt(argc, argv, "i:o:t:")) != -1)
+    while ((opt = getopt_long(argc, argv, "i:o:t:b:c:l:", long_options, nullptr)) != -1)
     {
         switch (opt)
         {
@@ -620,12 +2147,150 @@ int main(int argc, char *argv[])
         case 't':
             num_threads = std::stoul(optarg);
             break;
+        case 'b':
+            options.batch_size = std::stoll(optarg);
+            break;
+        case 'c':
+            options.root.compression = optarg;
+            break;
+        case 'l':
+            options.root.compression_level = std::stoi(optarg);
+            break;
+        case kBasketSize:
+            options.root.basket_size = std::stoi(optarg);
+            break;
+        case kAutoFlush:
+            options.root.auto_flush = std::stoll(optarg);
+            break;
+        case kAutoSave:
+            options.root.auto_save = std::stoll(optarg);
+            break;
+        case kRowGroupTasks:
+            options.row_group_lookahead = std::stoi(optarg);
+            break;
+        case kVectorLists:
+            options.root.vector_lists = true;
+            break;
+        case kScaledDecimals:
+            options.root.scaled_decimals = true;
+            break;
+        case kInclude:
+            for (const auto &name : SplitList(optarg))
+                options.columns.include.emplace_back(name);
+            break;
+        case kExclude:
+            for (const auto &name : SplitList(optarg))
+                options.columns.exclude.emplace_back(name);
+            break;
+        case kIncludeRegex:
+        case kExcludeRegex:
+            try
+            {
+                (opt == kIncludeRegex ? options.columns.includeRegex : options.columns.excludeRegex) = std::regex(optarg);
+            }
+            catch (const std::regex_error &e)
+            {
+                std::cerr << "Error: invalid regex " << optarg << ": " << e.what() << std::endl;
+                return 1;
+            }
+            break;
+        case kWhere:
+            try
+            {
+                options.where = ParseWhere(optarg);
+            }
+            catch (const std::invalid_argument &e)
+            {
+                std::cerr << "Error: invalid where expression: " << e.what() << std::endl;
+                return 1;
+            }
+            break;
+        case kFirst:
+            options.rows.first = std::stoll(optarg);
+            break;
+        case kLast:
+            options.rows.last = std::stoll(optarg);
+            break;
+        case kSample:
+            options.rows.sample = std::stod(optarg);
+            if (options.rows.sample <= 0 || (options.rows.sample > 1 && options.rows.sample != std::floor(options.rows.sample)))
+            {
+                std::cerr << "Error: --sample takes an integer stride or a fraction in (0, 1]" << std::endl;
+                return 1;
+            }
+            break;
+        case kStatsJson:
+            stats_json = optarg;
+            break;
+        case kStatsInterval:
+            stats_interval = std::stod(optarg);
+            break;
+        case kBranchTiming:
+            branch_timing = true;
+            break;
+        case kPipelineDepth:
+            options.pipeline_depth = std::stoi(optarg);
+            break;
+        case kRootImt:
+            root_imt = std::stoi(optarg);
+            break;
+        case kMerge:
+            merge_filename = optarg;
+            break;
+        case kMergeOrdered:
+            merge_ordered = true;
+            break;
+        case kMmap:
+            options.input.memory_map = true;
+            break;
+        case kPreBuffer:
+            options.input.pre_buffer = true;
+            break;
+        case kCacheHoleSize:
+            options.input.hole_size_limit = std::stoll(optarg);
+            break;
+        case kCacheRangeSize:
+            options.input.range_size_limit = std::stoll(optarg);
+            break;
+        case kCachePrefetch:
+            options.input.prefetch_limit = std::stoll(optarg);
+            break;
+        case kBufferSize:
+            options.input.buffer_size = std::stoll(optarg);
+            break;
+        case kArrowThreads:
+            if (std::string(optarg) == "auto")
+                arrow_threads = ThreadBudget::Mode::kAuto;
+            else if (std::string(optarg) == "on")
+                arrow_threads = ThreadBudget::Mode::kOn;
+            else if (std::string(optarg) == "off")
+                arrow_threads = ThreadBudget::Mode::kOff;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
         default:
             usage(argv[0]);
             return 1;
         }
     }
 
+    if (!options.root.compression.empty())
+    {
+        try
+        {
+            RootCompressionSettings(options.root.compression, options.root.compression_level);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
     if (input_dir.empty())
     {
         std::cerr << "Error: Input directory must be specified with -i flag" << std::endl;
@@ -639,45 +2304,105 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if (!std::filesystem::exists(output_dir))
+    if (merge_filename.empty() && !std::filesystem::exists(output_dir))
     {
         std::filesystem::create_directories(output_dir);
         std::cout << "Created output directory: " << output_dir << std::endl;
     }
 
+    // Input order, which merge mode keeps with --merge-ordered, is the path order
+    std::vector<DatasetFile> dataset = DiscoverDataset(input_dir);
+    if (dataset.empty())
+    {
+        std::cerr << "No parquet files found in directory: " << input_dir << std::endl;
+        return 1;
+    }
     std::vector<std::string> parquet_files;
-    for (const auto &entry : std::filesystem::directory_iterator(input_dir))
+    int64_t dataset_rows = 0;
+    int64_t dataset_bytes = 0;
+    for (const auto &file : dataset)
     {
-        if (entry.is_regular_file() && entry.path().extension() == ".parquet")
-        {
-            parquet_files.push_back(entry.path().string());
-        }
+        parquet_files.emplace_back(file.path);
+        dataset_rows += file.rows;
+        dataset_bytes += file.bytes;
     }
-
-    if (parquet_files.empty())
+    std::cout << "Found " << parquet_files.size() << " parquet files, " << dataset_rows << " rows, "
+              << dataset_bytes / 1e6 << " MB" << std::endl;
+
+    // Largest files first, so that a large file never starts last and sets the wall time
+    // --merge-ordered writes the files in path order, so they are started in that order: a file finished
+    // ahead of its predecessors is kept in memory until they are written
+    std::vector<size_t> schedule(dataset.size());
+    std::iota(schedule.begin(), schedule.end(), 0);
+    if (!merge_ordered)
     {
-        std::cerr << "No parquet files found in directory: " << input_dir << std::endl;
-        return 1;
+        std::stable_sort(schedule.begin(), schedule.end(), [&dataset](size_t a, size_t b)
+                         { return std::make_pair(dataset[a].bytes, dataset[a].rows) > std::make_pair(dataset[b].bytes, dataset[b].rows); });
     }
 
-    std::cout << "Found " << parquet_files.size() << " parquet files" << std::endl;
+    // The output directory mirrors the input one: dir/key=value/part.parquet -> output_dir/key=value/part.root
+    std::vector<std::string> root_files;
+    for (const auto &file : dataset)
+    {
+        auto root_file = std::filesystem::path(output_dir) / file.relative;
+        root_file.replace_extension(".root");
+        if (merge_filename.empty())
+            std::filesystem::create_directories(root_file.parent_path());
+        root_files.emplace_back(root_file.string());
+    }
 
     ROOT::EnableThreadSafety();
+    // TTree::Fill then compresses the baskets of the branches in parallel when flushing a cluster
+    if (root_imt >= 0)
+    {
+        ROOT::EnableImplicitMT(root_imt);
+        std::cout << "ROOT implicit MT enabled with " << ROOT::GetThreadPoolSize() << " threads" << std::endl;
+    }
 
-    ThreadPool pool(num_threads);
-
-    for (const auto &parquet_file : parquet_files)
+    ConversionStats stats(branch_timing);
     {
-        std::string filename = std::filesystem::path(parquet_file).stem().string();
-        std::string root_file = std::filesystem::path(output_dir) / (filename + ".root");
+        StatsReporter reporter(stats, stats_interval, stats_json);
+        // Destroyed after the pool, when all files are written to it, to finish the merged file
+        std::unique_ptr<MergedRootOutput> merged;
+        if (!merge_filename.empty())
+        {
+            merged = std::make_unique<MergedRootOutput>(merge_filename, options.root, merge_ordered);
+        }
+        ThreadPool pool(num_threads);
+        std::vector<int64_t> schedule_bytes;
+        for (size_t i : schedule)
+            schedule_bytes.push_back(dataset[i].bytes);
+        // Row group tasks decode on the pool instead of Arrow's threads: every file holds a single slot, and
+        // the pool threads left free are those that run the column tasks
+        ThreadBudget budget(options.row_group_lookahead > 0 ? ThreadBudget::Mode::kOff : arrow_threads, pool.size(),
+                            std::move(schedule_bytes));
+
+        // The pool runs its tasks in no particular order, so every task converts the largest file not yet started
+        for (size_t task = 0; task < parquet_files.size(); ++task)
+        {
+            pool.enqueue([&]()
+                         {
+                auto lease = budget.start_next();
+                const size_t i = schedule[lease->position()];
+                if (merged)
+                    MergeParquetIntoRoot(parquet_files[i], i, *merged, options, &pool, &stats, lease->use_arrow_threads());
+                else
+                    ConvertSingleParquetToRoot(parquet_files[i], root_files[i], options, &pool, &stats, lease->use_arrow_threads()); });
+        }
 
-        pool.enqueue([parquet_file, root_file]()
-                     { ConvertSingleParquetToRoot(parquet_file, root_file); });
+        std::cout << "Processing " << parquet_files.size() << " files." << std::endl;
+        pool.wait_for_completion();
     }
+    if (!merge_filename.empty())
+    {
+        stats.bytes_out += std::filesystem::file_size(merge_filename);
+    }
+    std::cout << stats.Summary() << std::endl;
+    stats.WriteJson(stats_json);
 
-    std::cout << "Processing " << parquet_files.size() << " files." << std::endl;
-    pool.wait_for_completion();
-
-    std::cout << "All conversions completed. Output files are in: " << output_dir << std::endl;
+    if (!merge_filename.empty())
+        std::cout << "All conversions completed. Output file: " << merge_filename << std::endl;
+    else
+        std::cout << "All conversions completed. Output files are in: " << output_dir << std::endl;
     return 0;
 }
@@ -13,27 +13,216 @@
 #include <functional>
 #include <string>
 #include <algorithm>
+#include <memory>
+#include <vector>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <optional>
+#include <limits>
+#include <sstream>
+#include <cmath>
+#include <regex>
+#include <iterator>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <getopt.h>
+#include <glob.h>
 #include "TROOT.h"
+#include "RVersion.h"
 #include "TFile.h"
+#include "TChain.h"
 #include "TTreeReader.h"
 #include "TTreeReaderValue.h"
 #include "TTreeReaderArray.h"
+#include "TTreeFormula.h"
+#include "TNotifyLink.h"
+#include "TLeaf.h"
+#include "TBufferFile.h"
+#include "Bytes.h"
 #include <arrow/api.h>
 #include <arrow/io/api.h>
 #include <arrow/ipc/api.h>
 #include <arrow/type.h>
+#include <arrow/util/compression.h>
 #include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+#include "converter_common.h"
 
 /** prints usage **/
 void usage(char *argv0)
 {
     std::cout << "[root2parquet]: Usage: \n"
-              << argv0 << " -i [input_root_file_name]\n"
-              << "-t [input_tree_name] (default: tree)"
-              << "-o [output_file_name] (default: [input_ridf_file_name].parquet)"
+              << argv0 << " -i [input] [more inputs...]\n"
+              << "   input: a ROOT file, a directory of ROOT files, a glob pattern or a .txt/.list file of ROOT file names\n"
+              << "-t [input_tree_name] (default: tree)\n"
+              << "-o [output_file_name] (default: [input_ridf_file_name].parquet)\n"
+              << "   all inputs are chained into one file, or converted one file each if the output is a directory (ends with /)\n"
+              << "-n [events_per_row_group] (default: 1000000, 0: no limit)\n"
+              << "-m [max_row_group_bytes] (default: 268435456, 0: no limit)\n"
+              << "-e [row|bulk] conversion engine (default: row)\n"
+              << "-j [num_threads] (default: 1, 0: number of CPU cores)\n"
+              << "-c, --compression [none|snappy|gzip|brotli|lz4|lz4_raw|zstd] (default: none)\n"
+              << "-l, --compression-level [level] (default: codec default)\n"
+              << "-d, --dictionary [on|off|column,...] dictionary encoding for all, no or the listed columns (default: on)\n"
+              << "-p, --page-size [bytes] data page size (default: 1048576)\n"
+              << "-s, --statistics [on|off] column chunk statistics (default: on)\n"
+              << "--max-file-rows [n], --max-file-bytes [bytes] start a new part file after n rows or about the given size;\n"
+              << "   the output is then a directory [output_file_name]/ of [stem]-00001.parquet, ... (default: 0, single file)\n"
+              << "--include [leaf,...], --exclude [leaf,...] leaves to convert / to skip (default: all)\n"
+              << "--include-regex [regex], --exclude-regex [regex] the same for leaf names fully matching regex\n"
+              << "--where [expression] convert only the entries passing the TTreeFormula expression, e.g. \"pt > 20 && nhit > 0\"\n"
+              << "--first [entry] --last [entry] convert only the entries first to last of the chain (default: all)\n"
+              << "   with an output directory, the entries are still numbered across all input files\n"
+              << "--sample [n|fraction] convert every n-th entry, or the given fraction of the entries evenly spaced\n"
+              << "--stats-json [file] write the conversion statistics as JSON at exit (and with every periodic report)\n"
+              << "--stats-interval [seconds] print the conversion statistics periodically (default: 0, at exit only)\n"
+              << "--branch-timing measure the conversion time of every branch (adds a timer call per entry and branch)"
               << std::endl;
 }
 
+/** Parquet writer settings given on the command line */
+struct WriterConfig
+{
+    std::string compression = "none";
+    std::optional<int> compressionLevel;
+    // "on", "off", or a comma separated list of the columns to dictionary encode
+    std::string dictionary = "on";
+    int64_t pageSize = 0;
+    bool statistics = true;
+};
+
+/** Parses on/off command line values */
+bool ParseOnOff(const std::string &value)
+{
+    if (value == "on")
+        return true;
+    if (value == "off")
+        return false;
+    throw std::invalid_argument("expected on or off, got " + value);
+}
+
+/**
+ * Builds the parquet WriterProperties from the configuration
+ * maxRowGroupEvents is passed on so that the writer does not split the row groups built by the converters
+ */
+std::shared_ptr<parquet::WriterProperties> MakeWriterProperties(const WriterConfig &config,
+                                                                const arrow::Schema &schema,
+                                                                long long maxRowGroupEvents)
+{
+    parquet::WriterProperties::Builder builder;
+
+    std::string codecName = config.compression == "none" ? "uncompressed" : config.compression;
+    arrow::Compression::type codec;
+    PARQUET_ASSIGN_OR_THROW(codec, arrow::util::Codec::GetCompressionType(codecName));
+    if (!arrow::util::Codec::IsAvailable(codec))
+    {
+        throw std::invalid_argument("Compression codec " + config.compression + " is not available in this Arrow build");
+    }
+    builder.compression(codec);
+    if (config.compressionLevel)
+    {
+        builder.compression_level(*config.compressionLevel);
+    }
+
+    if (config.dictionary == "on" || config.dictionary == "off")
+    {
+        if (ParseOnOff(config.dictionary))
+            builder.enable_dictionary();
+        else
+            builder.disable_dictionary();
+    }
+    else
+    {
+        builder.disable_dictionary();
+        for (const auto &name : SplitList(config.dictionary))
+        {
+            auto field = schema.GetFieldByName(name);
+            if (!field)
+            {
+                throw std::invalid_argument("Unknown column for dictionary encoding: " + name);
+            }
+            // Values of list columns are stored in the leaf column name.list.element
+            builder.enable_dictionary(field->type()->id() == arrow::Type::LIST ? name + ".list.element" : name);
+        }
+    }
+
+    if (config.pageSize > 0)
+    {
+        builder.data_pagesize(config.pageSize);
+    }
+    if (config.statistics)
+        builder.enable_statistics();
+    else
+        builder.disable_statistics();
+    builder.max_row_group_length(maxRowGroupEvents > 0 ? maxRowGroupEvents : std::numeric_limits<int64_t>::max());
+
+    return builder.build();
+}
+
+/**
+ * Conversion phases and throughput counters of root2parquet
+ * Bytes read are taken from TFile, which counts the reads of all files.
+ */
+class ConversionStats : public ConversionStatsBase
+{
+public:
+    enum Phase
+    {
+        kOpen,    // opening the inputs, scanning leaves and creating converters
+        kSelect,  // --where and --sample selection, including the reads of the formula branches
+        kRead,    // basket reads and decompression of bulk converters
+        kConvert, // filling the column builders, including the reads of row-wise branches
+        kFinish,  // finishing the column builders into row group tables
+        kWrite,   // parquet encoding, compression and writing of row groups
+        kNumPhases
+    };
+
+    explicit ConversionStats(bool branchTiming = false)
+        : ConversionStatsBase({"open", "select", "read", "convert", "finish", "write"}, branchTiming) {}
+
+    /** Adds the written output files to the output bytes */
+    void AddOutput(const std::vector<std::string> &files)
+    {
+        for (const auto &file : files)
+            bytesOut += std::filesystem::file_size(file);
+    }
+
+    std::atomic<long long> entries{0};
+    std::atomic<long long> rows{0};
+    std::atomic<long long> rowGroups{0};
+    std::atomic<long long> bytesOut{0};
+
+protected:
+    void SummarizeCounters(std::ostream &out, double elapsed) const override
+    {
+        const double mbIn = TFile::GetFileBytesRead() / 1e6;
+        const double mbOut = bytesOut / 1e6;
+        out << "  entries " << entries << " (" << entries / elapsed << " /s), rows " << rows << " in " << rowGroups << " row groups\n"
+            << "  read " << mbIn << " MB (" << mbIn / elapsed << " MB/s), written " << mbOut << " MB (" << mbOut / elapsed << " MB/s)\n";
+    }
+
+    void CountersJson(std::ostream &out) const override
+    {
+        out << ", \"entries\": " << entries << ", \"rows\": " << rows << ", \"row_groups\": " << rowGroups
+            << ", \"bytes_in\": " << TFile::GetFileBytesRead() << ", \"bytes_out\": " << bytesOut;
+    }
+
+    /** Bulk reads happen within the conversion and are reported separately */
+    double PhaseSeconds(int phase) const override
+    {
+        int64_t nanos = PhaseNanos(phase);
+        if (phase == kConvert)
+            nanos -= PhaseNanos(kRead);
+        return nanos / 1e9;
+    }
+};
+
 /** Helper function to parse array information from leaf title */
 struct ArrayInfo
 {
@@ -77,64 +266,336 @@ ArrayInfo parseArrayInfo(const std::string &leafTitle, const std::string &leafNa
     return info;
 }
 
-// Main function
-int main(int argc, char **argv)
+/**
+ * Type traits table mapping a ROOT leaf type to the Apache Arrow builder and data type
+ *
+ * Add a specialization here and a line to VisitLeafType() to support more data types
+ */
+template <typename T>
+struct ArrowTraits;
+
+#define ROOT2PARQUET_ARROW_TRAITS(CType, Builder, TypeFactory)    \
+    template <>                                                   \
+    struct ArrowTraits<CType>                                     \
+    {                                                             \
+        using BuilderType = Builder;                              \
+        static std::shared_ptr<arrow::DataType> type() { return TypeFactory(); } \
+    };
+
+ROOT2PARQUET_ARROW_TRAITS(Double_t, arrow::DoubleBuilder, arrow::float64)
+ROOT2PARQUET_ARROW_TRAITS(Float_t, arrow::FloatBuilder, arrow::float32)
+ROOT2PARQUET_ARROW_TRAITS(Int_t, arrow::Int32Builder, arrow::int32)
+ROOT2PARQUET_ARROW_TRAITS(Long64_t, arrow::Int64Builder, arrow::int64)
+ROOT2PARQUET_ARROW_TRAITS(ULong64_t, arrow::UInt64Builder, arrow::uint64)
+ROOT2PARQUET_ARROW_TRAITS(Short_t, arrow::Int16Builder, arrow::int16)
+ROOT2PARQUET_ARROW_TRAITS(UShort_t, arrow::UInt16Builder, arrow::uint16)
+ROOT2PARQUET_ARROW_TRAITS(Bool_t, arrow::BooleanBuilder, arrow::boolean)
+ROOT2PARQUET_ARROW_TRAITS(UInt_t, arrow::UInt32Builder, arrow::uint32)
+ROOT2PARQUET_ARROW_TRAITS(Char_t, arrow::Int8Builder, arrow::int8)
+ROOT2PARQUET_ARROW_TRAITS(UChar_t, arrow::UInt8Builder, arrow::uint8)
+
+#undef ROOT2PARQUET_ARROW_TRAITS
+
+/**
+ * Calls visitor with a default constructed value of the type named by typeName
+ * Both ROOT type names (Double_t) and C++ type names (double) as found in vector<> or RVec<> are accepted
+ * Returns false if the type is not supported
+ */
+template <typename Visitor>
+bool VisitLeafType(const std::string &typeName, Visitor &&visitor)
 {
-    /** parsing commandline arguments **/
-    if (argc < 3)
+    if (typeName == "Double_t" || typeName == "double")
+        visitor(Double_t{});
+    else if (typeName == "Float_t" || typeName == "float")
+        visitor(Float_t{});
+    else if (typeName == "Int_t" || typeName == "int")
+        visitor(Int_t{});
+    else if (typeName == "Long64_t" || typeName == "int64_t" || typeName == "long long")
+        visitor(Long64_t{});
+    else if (typeName == "ULong64_t" || typeName == "uint64_t" || typeName == "unsigned long long")
+        visitor(ULong64_t{});
+    else if (typeName == "Short_t" || typeName == "short")
+        visitor(Short_t{});
+    else if (typeName == "UShort_t" || typeName == "unsigned short")
+        visitor(UShort_t{});
+    else if (typeName == "Bool_t" || typeName == "bool")
+        visitor(Bool_t{});
+    else if (typeName == "UInt_t" || typeName == "unsigned int")
+        visitor(UInt_t{});
+    else if (typeName == "Char_t" || typeName == "char")
+        visitor(Char_t{});
+    else if (typeName == "UChar_t" || typeName == "unsigned char")
+        visitor(UChar_t{});
+    else
+        return false;
+    return true;
+}
+
+/** Returns the element type name of a vector<T> or ROOT::VecOps::RVec<T> type name, or an empty string */
+std::string CollectionElementType(const std::string &typeName)
+{
+    for (const std::string prefix : {"vector<", "ROOT::VecOps::RVec<"})
     {
-        usage(argv[0]);
-        return 1;
+        if (typeName.rfind(prefix, 0) == 0 && typeName.back() == '>')
+        {
+            return typeName.substr(prefix.size(), typeName.size() - prefix.size() - 1);
+        }
     }
+    return "";
+}
 
-    std::string input_file_name = "";
-    std::string tree_name = "tree";
-    std::string output_file_name = "default";
-    int opt = 0;
-    while ((opt = getopt(argc, argv, "i:o:t:")) != -1)
-    {
-        switch (opt)
-        {
-        case 'i':
-            input_file_name = optarg;
-            break;
-        case 'o':
-            output_file_name = optarg;
-            break;
-        case 't':
-            tree_name = optarg;
-            break;
-        default:
-            usage(argv[0]);
-            return 1;
-            break;
+/** Appends n contiguous values to a builder with a single copy */
+template <typename Builder, typename T>
+arrow::Status AppendBulk(Builder &builder, const T *values, int64_t n)
+{
+    // ROOT and Arrow spell 64 bit and char types differently but with identical layouts
+    static_assert(sizeof(T) == sizeof(typename Builder::value_type), "size mismatch between ROOT and Arrow types");
+    return builder.AppendValues(reinterpret_cast<const typename Builder::value_type *>(values), n);
+}
+
+inline arrow::Status AppendBulk(arrow::BooleanBuilder &builder, const Bool_t *values, int64_t n)
+{
+    return builder.AppendValues(reinterpret_cast<const uint8_t *>(values), n);
+}
+
+/** A leaf selected for conversion by the branch scan */
+struct LeafSpec
+{
+    std::string name;
+    // Name of the branch holding the leaf
+    std::string branchName;
+    // ROOT type name of a scalar or of the array elements
+    std::string elementType;
+    ArrayInfo arrayInfo;
+    // true for [] arrays, vector<T> and RVec<T>
+    bool isList = false;
+};
+
+/**
+ * Converts one branch into an Apache Arrow column
+ *
+ * Row-wise converters append the current TTreeReader entry in Fill(),
+ * bulk converters read whole baskets of their branch in FillEntries()
+ */
+class ColumnConverter
+{
+public:
+    virtual ~ColumnConverter() = default;
+    /** Appends the current TTreeReader entry to the column builder */
+    virtual void Fill() {}
+    /** Appends the entries [begin, end) of the branch to the column builder, only entries with selected[entry - begin] if given */
+    virtual void FillEntries(Long64_t begin, Long64_t end, const char *selected = nullptr) {}
+    /** true if the converter reads its branch with FillEntries() instead of the TTreeReader */
+    virtual bool IsBulk() const { return false; }
+    /** Builder of the column, finished once per row group */
+    virtual std::shared_ptr<arrow::ArrayBuilder> builder() const = 0;
+    std::shared_ptr<arrow::Field> field() const { return field_; }
+    const std::string &name() const { return field_->name(); }
+
+    /** Reports the read time and, with branch timing, the time of this branch to stats */
+    void SetStats(ConversionStats *stats)
+    {
+        stats_ = stats;
+        branchTimer_ = stats ? stats->BranchTimer(name()) : nullptr;
+    }
+    /** Fill() timed by the branch timer */
+    void TimedFill()
+    {
+        if (!branchTimer_)
+            return Fill();
+        auto start = ConversionStats::Clock::now();
+        Fill();
+        *branchTimer_ += std::chrono::duration_cast<std::chrono::nanoseconds>(ConversionStats::Clock::now() - start).count();
+    }
+    /** FillEntries() timed by the branch timer */
+    void TimedFillEntries(Long64_t begin, Long64_t end, const char *selected)
+    {
+        if (!branchTimer_)
+            return FillEntries(begin, end, selected);
+        auto start = ConversionStats::Clock::now();
+        FillEntries(begin, end, selected);
+        *branchTimer_ += std::chrono::duration_cast<std::chrono::nanoseconds>(ConversionStats::Clock::now() - start).count();
+    }
+
+protected:
+    std::shared_ptr<arrow::Field> field_;
+    ConversionStats *stats_ = nullptr;
+    std::atomic<int64_t> *branchTimer_ = nullptr;
+};
+
+/** Converter for a scalar leaf to a primitive Arrow column */
+template <typename T>
+class ScalarConverter : public ColumnConverter
+{
+public:
+    using BuilderType = typename ArrowTraits<T>::BuilderType;
+
+    ScalarConverter(TTreeReader &reader, const std::string &name, arrow::MemoryPool *pool)
+        : value_(reader, name.c_str()), builder_(std::make_shared<BuilderType>(pool))
+    {
+        field_ = arrow::field(name, ArrowTraits<T>::type());
+    }
+    void Fill() override
+    {
+        PARQUET_THROW_NOT_OK(builder_->Append(*value_.Get()));
+    }
+    std::shared_ptr<arrow::ArrayBuilder> builder() const override { return builder_; }
+
+private:
+    TTreeReaderValue<T> value_;
+    std::shared_ptr<BuilderType> builder_;
+};
+
+/** Converter for a fixed or variable size array, vector<T> or RVec<T> leaf to an Arrow list column */
+template <typename T>
+class ArrayConverter : public ColumnConverter
+{
+public:
+    using BuilderType = typename ArrowTraits<T>::BuilderType;
+
+    ArrayConverter(TTreeReader &reader, const std::string &name, const ArrayInfo &arrayInfo, arrow::MemoryPool *pool)
+        : array_(reader, name.c_str()),
+          valueBuilder_(std::make_shared<BuilderType>(pool)),
+          listBuilder_(std::make_shared<arrow::ListBuilder>(pool, valueBuilder_)),
+          fixedSize_(arrayInfo.isFixedSize ? arrayInfo.fixedSize : -1)
+    {
+        field_ = arrow::field(name, arrow::list(ArrowTraits<T>::type()));
+    }
+    void Fill() override
+    {
+        PARQUET_THROW_NOT_OK(listBuilder_->Append());
+        int size = array_.GetSize();
+        // Use the smaller size of fixed size arrays for safety
+        if (fixedSize_ >= 0)
+            size = std::min(fixedSize_, size);
+        if (size == 0)
+            return;
+        // Arrays and vectors of basic types are usually contiguous in memory and copied with a single call;
+        // ROOT versions without IsContiguous() always take the per-element path
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6, 22, 0)
+        if (array_.IsContiguous())
+        {
+            PARQUET_THROW_NOT_OK(AppendBulk(*valueBuilder_, &array_[0], size));
+            return;
+        }
+#endif
+        PARQUET_THROW_NOT_OK(valueBuilder_->Reserve(size));
+        for (int i = 0; i < size; ++i)
+        {
+            valueBuilder_->UnsafeAppend(array_[i]);
         }
     }
-    // The default output file name will be [input_file_name -.root].parquet
-    if (output_file_name == "default")
+    std::shared_ptr<arrow::ArrayBuilder> builder() const override { return listBuilder_; }
+
+private:
+    TTreeReaderArray<T> array_;
+    std::shared_ptr<BuilderType> valueBuilder_;
+    std::shared_ptr<arrow::ListBuilder> listBuilder_;
+    int fixedSize_;
+};
+
+/**
+ * Columnar converter for a scalar leaf reading whole baskets with the ROOT bulk IO API
+ *
+ * TBulkBranchRead only reads from the first entry of a basket, so the serialized basket
+ * containing the requested entries is kept and decoded from big endian as needed
+ */
+template <typename T>
+class BulkScalarConverter : public ColumnConverter
+{
+public:
+    using BuilderType = typename ArrowTraits<T>::BuilderType;
+
+    BulkScalarConverter(TTree *tree, const std::string &name, arrow::MemoryPool *pool)
+        : tree_(tree), buffer_(TBuffer::kWrite, 32 * 1024), builder_(std::make_shared<BuilderType>(pool))
     {
-        output_file_name = input_file_name.substr(0, input_file_name.length() - 4) + "parquet";
-        std::cout << "output_file_name = " << output_file_name << std::endl;
+        field_ = arrow::field(name, ArrowTraits<T>::type());
+    }
+    bool IsBulk() const override { return true; }
+    void FillEntries(Long64_t begin, Long64_t end, const char *selected = nullptr) override
+    {
+        PARQUET_THROW_NOT_OK(builder_->Reserve(end - begin));
+        // Between calls, other readers of the chain may have loaded other trees and then this one again,
+        // at the same number; the decoded basket stays valid, but the branch is looked up again
+        currentTreeNumber_ = -1;
+        const Long64_t first = begin;
+        while (begin < end)
+        {
+            if (begin < basketFirst_ || begin >= basketFirst_ + basketEntries_)
+            {
+                ReadBasket(begin);
+            }
+            Long64_t last = std::min(end, basketFirst_ + basketEntries_);
+            char *data = buffer_.GetCurrent() + (begin - basketFirst_) * sizeof(T);
+            for (Long64_t i = begin; i < last; ++i)
+            {
+                T value;
+                frombuf(data, &value);
+                if (!selected || selected[i - first])
+                    builder_->UnsafeAppend(value);
+            }
+            begin = last;
+        }
     }
+    std::shared_ptr<arrow::ArrayBuilder> builder() const override { return builder_; }
 
-    // Map of Apache Arrow Builders, and corresponding fill functions
-    auto pool = arrow::default_memory_pool();
-    std::map<std::string, std::shared_ptr<arrow::ArrayBuilder>> builders;
-    std::map<std::string, std::shared_ptr<arrow::Field>> fields;
-    std::map<std::string, std::function<void(const std::string &)>> functions;
-    // Map of ROOT TTreeReaderValues and Arrays
-    std::map<std::string, ROOT::Internal::TTreeReaderArrayBase *> arrayReaders;
-    std::map<std::string, ROOT::Internal::TTreeReaderValueBase *> valueReaders;
-    // Map to store array size information
-    std::map<std::string, std::string> arraySizeBranches; // maps array name to size branch name
-    std::map<std::string, int> fixedArraySizes;           // maps array name to fixed size
-
-    // Open input ROOT file
-    TFile rfile(input_file_name.c_str());
-    auto tree = (TTree *)rfile.Get(tree_name.c_str());
-    TTreeReader reader(tree);
-
-    // Scans branches and leaves in the TTree
+    /** Whether a branch holds a single leaf the bulk IO API can read */
+    static bool Supports(TBranch *branch)
+    {
+        return branch && branch->GetListOfLeaves()->GetEntries() == 1 && branch->SupportsBulkRead();
+    }
+
+private:
+    /**
+     * Reads the basket holding entry
+     * entry counts over all files of a chain; baskets are found with the entry number in the current file
+     */
+    void ReadBasket(Long64_t entry)
+    {
+        PhaseTimer timer(stats_, ConversionStats::kRead);
+        const Long64_t local = tree_->LoadTree(entry);
+        if (local < 0)
+        {
+            throw std::runtime_error("Failed to load entry " + std::to_string(entry) + " of branch " + field_->name());
+        }
+        // A chain allocates a new tree on every load, possibly at the address of the previous one,
+        // so the tree is recognized by its number
+        if (tree_->GetTreeNumber() != currentTreeNumber_)
+        {
+            currentTreeNumber_ = tree_->GetTreeNumber();
+            TTree *current = tree_->GetTree();
+            branch_ = current->GetBranch(field_->name().c_str());
+            if (!Supports(branch_))
+            {
+                throw std::runtime_error("Branch " + field_->name() + " cannot be bulk read in " + current->GetName());
+            }
+        }
+        // Find the first entry of the basket holding entry
+        const Long64_t *basketEntry = branch_->GetBasketEntry();
+        const Long64_t *basketEnd = basketEntry + branch_->GetWriteBasket() + 1;
+        Long64_t first = *(std::upper_bound(basketEntry, basketEnd, local) - 1);
+        Int_t n = branch_->GetBulkRead().GetEntriesSerialized(first, buffer_);
+        if (n <= 0 || first + n <= local)
+        {
+            throw std::runtime_error(std::string("Bulk read failed for branch ") + branch_->GetName() + " at entry " + std::to_string(entry));
+        }
+        basketFirst_ = entry - local + first;
+        basketEntries_ = n;
+    }
+
+    TTree *tree_;
+    Int_t currentTreeNumber_ = -1;
+    TBranch *branch_ = nullptr;
+    TBufferFile buffer_;
+    Long64_t basketFirst_ = 0;
+    Long64_t basketEntries_ = 0;
+    std::shared_ptr<BuilderType> builder_;
+};
+
+/** Scans branches and leaves in the TTree and returns the leaves of supported types */
+std::vector<LeafSpec> ScanLeaves(TTree *tree)
+{
+    std::vector<LeafSpec> leaves;
     auto branches = tree->GetListOfBranches();
     for (int i = 0; i < branches->GetEntries(); ++i)
     {
@@ -162,534 +623,1189 @@ int main(int argc, char **argv)
             }
             std::cout << std::endl;
 
-            // Store array information for later use
-            if (arrayInfo.isArray)
+            LeafSpec spec;
+            spec.name = lName;
+            spec.branchName = br->GetName();
+            spec.arrayInfo = arrayInfo;
+            std::string collectionType = CollectionElementType(lType);
+            if (!collectionType.empty())
             {
-                if (arrayInfo.isFixedSize)
-                {
-                    fixedArraySizes[lName] = arrayInfo.fixedSize;
-                }
-                else
-                {
-                    arraySizeBranches[lName] = arrayInfo.sizeBranch;
-                }
+                spec.elementType = collectionType;
+                spec.isList = true;
             }
-            /**
-             * Type specific procedure to fill tree entries to Apache arrow
-             *
-             * builders[lName] = std::make_shared<arrow::ArrayBuilder>(pool); : Create ArrayBuilder for the specific type
-             * fields.emlace_back(arrow::field(column_name, type)); : Append arrow::field object to the FieldVector for generating schema
-             * valueReaders[lName] = new TTreeReaderValue<type>(reader, lName.c_str()); : Create TTreeReaderValue for the branch
-             * function[lName] =[](const std::string &name) {}; : Define a function to fill a branch entry to the arrow builder
-             */
-            if (lTitle == lName && !arrayInfo.isArray)
+            else if (arrayInfo.isArray)
             {
-                if (lType == "Double_t")
-                {
-                    builders[lName] = std::make_shared<arrow::DoubleBuilder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::float64()));
-                    valueReaders[lName] = new TTreeReaderValue<Double_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::DoubleBuilder *>(builders[name].get())->Append(*((TTreeReaderValue<Double_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "Float_t")
-                {
-                    builders[lName] = std::make_shared<arrow::FloatBuilder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::float32()));
-                    valueReaders[lName] = new TTreeReaderValue<Float_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::FloatBuilder *>(builders[name].get())->Append(*((TTreeReaderValue<Float_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "Int_t")
-                {
-                    builders[lName] = std::make_shared<arrow::Int32Builder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::int32()));
-                    valueReaders[lName] = new TTreeReaderValue<Int_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::Int32Builder *>(builders[name].get())->Append(*((TTreeReaderValue<Int_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "Long64_t")
-                {
-                    builders[lName] = std::make_shared<arrow::Int64Builder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::int64()));
-                    valueReaders[lName] = new TTreeReaderValue<Long64_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::Int64Builder *>(builders[name].get())->Append(*((TTreeReaderValue<Long64_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "ULong64_t")
-                {
-                    builders[lName] = std::make_shared<arrow::UInt64Builder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::uint64()));
-                    valueReaders[lName] = new TTreeReaderValue<ULong64_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::UInt64Builder *>(builders[name].get())->Append(*((TTreeReaderValue<ULong64_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "Short_t")
-                {
-                    builders[lName] = std::make_shared<arrow::Int16Builder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::int16()));
-                    valueReaders[lName] = new TTreeReaderValue<Short_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::Int16Builder *>(builders[name].get())->Append(*((TTreeReaderValue<Short_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "UShort_t")
-                {
-                    builders[lName] = std::make_shared<arrow::UInt16Builder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::uint16()));
-                    valueReaders[lName] = new TTreeReaderValue<UShort_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::UInt16Builder *>(builders[name].get())->Append(*((TTreeReaderValue<UShort_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "Bool_t")
-                {
-                    builders[lName] = std::make_shared<arrow::BooleanBuilder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::boolean()));
-                    valueReaders[lName] = new TTreeReaderValue<Bool_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::BooleanBuilder *>(builders[name].get())->Append(*((TTreeReaderValue<Bool_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "UInt_t")
-                {
-                    builders[lName] = std::make_shared<arrow::UInt32Builder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::uint32()));
-                    valueReaders[lName] = new TTreeReaderValue<UInt_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::UInt32Builder *>(builders[name].get())->Append(*((TTreeReaderValue<UInt_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "Char_t")
-                {
-                    builders[lName] = std::make_shared<arrow::Int8Builder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::int8()));
-                    valueReaders[lName] = new TTreeReaderValue<Char_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::Int8Builder *>(builders[name].get())->Append(*((TTreeReaderValue<Char_t> *)valueReaders[name])->Get()));
-                    };
-                }
-                else if (lType == "UChar_t")
-                {
-                    builders[lName] = std::make_shared<arrow::UInt8Builder>(pool);
-                    fields[lName] = (arrow::field(lName, arrow::uint8()));
-                    valueReaders[lName] = new TTreeReaderValue<UChar_t>(reader, lName.c_str());
-                    functions[lName] = [&builders, &valueReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::UInt8Builder *>(builders[name].get())->Append(*((TTreeReaderValue<UChar_t> *)valueReaders[name])->Get()));
-                    };
-                }
+                spec.elementType = lType;
+                spec.isList = true;
             }
-            // Definitions for array types (improved handling for different array formats)
-            if (lType == "ROOT::VecOps::RVec<double>" || lType == "vector<double>" || (arrayInfo.isArray && lType == "Double_t"))
+            else if (lTitle == lName)
             {
-                builders[lName] = std::make_shared<arrow::DoubleBuilder>(pool);
-                builders[lName + "L"] = std::make_shared<arrow::ListBuilder>(pool, builders[lName]);
-                fields[lName + "L"] = (arrow::field(lName, arrow::list(arrow::float64())));
-                arrayReaders[lName] = new TTreeReaderArray<Double_t>(reader, lName.c_str());
-
-                // Enhanced function to handle different array types
-                if (arrayInfo.isFixedSize)
-                {
-                    functions[lName] = [&builders, &arrayReaders, &fixedArraySizes](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        auto *array = (TTreeReaderArray<Double_t> *)arrayReaders[name];
-                        int expectedSize = fixedArraySizes[name];
-                        int actualSize = array->GetSize();
-                        int size = std::min(expectedSize, actualSize); // Use the smaller size for safety
-                        for (int i = 0; i < size; ++i)
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::DoubleBuilder *>(builders[name].get())->Append((*array)[i]));
-                        }
-                    };
-                }
-                else
-                {
-                    functions[lName] = [&builders, &arrayReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        for (auto &v : *(TTreeReaderArray<Double_t> *)arrayReaders[name])
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::DoubleBuilder *>(builders[name].get())->Append(v));
-                        }
-                    };
-                }
+                spec.elementType = lType;
             }
-            else if (lType == "ROOT::VecOps::RVec<float>" || lType == "vector<float>" || (arrayInfo.isArray && lType == "Float_t"))
+            else
             {
-                builders[lName] = std::make_shared<arrow::FloatBuilder>(pool);
-                builders[lName + "L"] = std::make_shared<arrow::ListBuilder>(pool, builders[lName]);
-                fields[lName + "L"] = (arrow::field(lName, arrow::list(arrow::float32())));
-                arrayReaders[lName] = new TTreeReaderArray<Float_t>(reader, lName.c_str());
-
-                if (arrayInfo.isFixedSize)
-                {
-                    functions[lName] = [&builders, &arrayReaders, &fixedArraySizes](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        auto *array = (TTreeReaderArray<Float_t> *)arrayReaders[name];
-                        int expectedSize = fixedArraySizes[name];
-                        int actualSize = array->GetSize();
-                        int size = std::min(expectedSize, actualSize);
-                        for (int i = 0; i < size; ++i)
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::FloatBuilder *>(builders[name].get())->Append((*array)[i]));
-                        }
-                    };
-                }
-                else
-                {
-                    functions[lName] = [&builders, &arrayReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        for (auto &v : *(TTreeReaderArray<Float_t> *)arrayReaders[name])
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::FloatBuilder *>(builders[name].get())->Append(v));
-                        }
-                    };
-                }
+                continue;
             }
-            else if (lType == "ROOT::VecOps::RVec<int>" || lType == "vector<int>" || (arrayInfo.isArray && lType == "Int_t"))
+            if (!VisitLeafType(spec.elementType, [](auto) {}))
             {
-                builders[lName] = std::make_shared<arrow::Int32Builder>(pool);
-                builders[lName + "L"] = std::make_shared<arrow::ListBuilder>(pool, builders[lName]);
-                fields[lName + "L"] = (arrow::field(lName, arrow::list(arrow::int32())));
-                arrayReaders[lName] = new TTreeReaderArray<Int_t>(reader, lName.c_str());
-
-                if (arrayInfo.isFixedSize)
-                {
-                    functions[lName] = [&builders, &arrayReaders, &fixedArraySizes](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        auto *array = (TTreeReaderArray<Int_t> *)arrayReaders[name];
-                        int expectedSize = fixedArraySizes[name];
-                        int actualSize = array->GetSize();
-                        int size = std::min(expectedSize, actualSize);
-                        for (int i = 0; i < size; ++i)
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::Int32Builder *>(builders[name].get())->Append((*array)[i]));
-                        }
-                    };
-                }
-                else
-                {
-                    functions[lName] = [&builders, &arrayReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        for (auto &v : *(TTreeReaderArray<Int_t> *)arrayReaders[name])
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::Int32Builder *>(builders[name].get())->Append(v));
-                        }
-                    };
-                }
+                std::cout << "  Skipping unsupported type " << lType << " of " << lName << std::endl;
+                continue;
             }
-            else if (lType == "ROOT::VecOps::RVec<short>" || lType == "vector<short>" || (arrayInfo.isArray && lType == "Short_t"))
-            {
-                builders[lName] = std::make_shared<arrow::Int16Builder>(pool);
-                builders[lName + "L"] = std::make_shared<arrow::ListBuilder>(pool, builders[lName]);
-                fields[lName + "L"] = (arrow::field(lName, arrow::list(arrow::int16())));
-                arrayReaders[lName] = new TTreeReaderArray<Short_t>(reader, lName.c_str());
+            leaves.emplace_back(spec);
+        }
+    }
+    // Columns are written in the order of the leaf names
+    std::sort(leaves.begin(), leaves.end(), [](const LeafSpec &a, const LeafSpec &b)
+              { return a.name < b.name; });
+    return leaves;
+}
 
-                if (arrayInfo.isFixedSize)
-                {
-                    functions[lName] = [&builders, &arrayReaders, &fixedArraySizes](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        auto *array = (TTreeReaderArray<Short_t> *)arrayReaders[name];
-                        int expectedSize = fixedArraySizes[name];
-                        int actualSize = array->GetSize();
-                        int size = std::min(expectedSize, actualSize);
-                        for (int i = 0; i < size; ++i)
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::Int16Builder *>(builders[name].get())->Append((*array)[i]));
-                        }
-                    };
-                }
-                else
-                {
-                    functions[lName] = [&builders, &arrayReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        for (auto &v : *(TTreeReaderArray<Short_t> *)arrayReaders[name])
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::Int16Builder *>(builders[name].get())->Append(v));
-                        }
-                    };
-                }
-            }
-            else if (lType == "ROOT::VecOps::RVec<int64_t>" || lType == "vector<int64_t>" || (arrayInfo.isArray && lType == "Long64_t"))
-            {
-                builders[lName] = std::make_shared<arrow::Int64Builder>(pool);
-                builders[lName + "L"] = std::make_shared<arrow::ListBuilder>(pool, builders[lName]);
-                fields[lName + "L"] = (arrow::field(lName, arrow::list(arrow::int64())));
-                arrayReaders[lName] = new TTreeReaderArray<Long64_t>(reader, lName.c_str());
+/**
+ * Creates the typed converters for the leaves, binding their readers to reader
+ * Scalars come first so that size variables are read before the arrays depending on them
+ * With bulk, scalar leaves the ROOT bulk IO API can read are converted basket by basket
+ */
+std::vector<std::unique_ptr<ColumnConverter>> MakeConverters(TTreeReader &reader,
+                                                             const std::vector<LeafSpec> &leaves,
+                                                             arrow::MemoryPool *pool,
+                                                             bool bulk = false)
+{
+    std::vector<std::unique_ptr<ColumnConverter>> scalars;
+    std::vector<std::unique_ptr<ColumnConverter>> arrays;
+    for (const auto &leaf : leaves)
+    {
+        TBranch *branch = (bulk && !leaf.isList) ? reader.GetTree()->GetBranch(leaf.name.c_str()) : nullptr;
+        VisitLeafType(leaf.elementType, [&](auto value)
+                      {
+                          using T = decltype(value);
+                          if (leaf.isList)
+                              arrays.emplace_back(std::make_unique<ArrayConverter<T>>(reader, leaf.name, leaf.arrayInfo, pool));
+                          else if (BulkScalarConverter<T>::Supports(branch))
+                              scalars.emplace_back(std::make_unique<BulkScalarConverter<T>>(reader.GetTree(), leaf.name, pool));
+                          else
+                              scalars.emplace_back(std::make_unique<ScalarConverter<T>>(reader, leaf.name, pool)); });
+    }
+    for (auto &a : arrays)
+    {
+        scalars.emplace_back(std::move(a));
+    }
+    return scalars;
+}
 
-                if (arrayInfo.isFixedSize)
-                {
-                    functions[lName] = [&builders, &arrayReaders, &fixedArraySizes](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        auto *array = (TTreeReaderArray<Long64_t> *)arrayReaders[name];
-                        int expectedSize = fixedArraySizes[name];
-                        int actualSize = array->GetSize();
-                        int size = std::min(expectedSize, actualSize);
-                        for (int i = 0; i < size; ++i)
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::Int64Builder *>(builders[name].get())->Append((*array)[i]));
-                        }
-                    };
-                }
-                else
-                {
-                    functions[lName] = [&builders, &arrayReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        for (auto &v : *(TTreeReaderArray<Long64_t> *)arrayReaders[name])
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::Int64Builder *>(builders[name].get())->Append(v));
-                        }
-                    };
-                }
+/** Schema and column builders of the converters, in output column order */
+std::shared_ptr<arrow::Schema> MakeSchema(const std::vector<std::unique_ptr<ColumnConverter>> &converters,
+                                          std::vector<std::shared_ptr<arrow::ArrayBuilder>> &columnBuilders)
+{
+    // Converters are ordered scalars first; restore the order of the leaf names for the output
+    std::vector<const ColumnConverter *> ordered;
+    for (const auto &c : converters)
+    {
+        ordered.emplace_back(c.get());
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const ColumnConverter *a, const ColumnConverter *b)
+              { return a->name() < b->name(); });
+
+    arrow::FieldVector fieldVec;
+    columnBuilders.clear();
+    for (const auto *c : ordered)
+    {
+        fieldVec.emplace_back(c->field());
+        columnBuilders.emplace_back(c->builder());
+    }
+    return arrow::schema(fieldVec);
+}
+
+/** Number of entries converted between two estimates of the buffered row group size */
+constexpr long long kByteCheckInterval = 1000;
+
+/**
+ * Converts the entries [begin, end) into the column builders
+ * Bulk converters fill their column in one pass, the others are filled entry by entry through reader,
+ * which has to be positioned just before begin
+ * If selected is given, only the entries with selected[entry - begin] are appended
+ * Returns the number of appended entries
+ */
+Long64_t ConvertEntries(TTreeReader &reader,
+                        const std::vector<ColumnConverter *> &bulkConverters,
+                        const std::vector<ColumnConverter *> &rowConverters,
+                        Long64_t begin, Long64_t end, const char *selected = nullptr)
+{
+    for (auto *c : bulkConverters)
+    {
+        c->TimedFillEntries(begin, end, selected);
+    }
+    const Long64_t appended = selected ? std::count(selected, selected + (end - begin), 1) : end - begin;
+    if (rowConverters.empty())
+        return appended;
+    for (Long64_t entry = begin; entry < end; ++entry)
+    {
+        if (!reader.Next())
+        {
+            throw std::runtime_error("Failed to read entry " + std::to_string(entry));
+        }
+        // Branches are read by the converters, so skipped entries are not read
+        if (selected && !selected[entry - begin])
+            continue;
+        for (auto *c : rowConverters)
+        {
+            c->TimedFill();
+        }
+    }
+    return appended;
+}
+
+/** Approximate number of bytes held by the column builders of the current row group */
+int64_t EstimateBufferedBytes(const std::vector<std::shared_ptr<arrow::ArrayBuilder>> &columnBuilders)
+{
+    int64_t bytes = 0;
+    for (const auto &builder : columnBuilders)
+    {
+        auto *b = builder.get();
+        // Lists hold an offset per entry plus the values of their child builder
+        while (b->type()->id() == arrow::Type::LIST)
+        {
+            bytes += b->length() * sizeof(int32_t);
+            b = static_cast<arrow::ListBuilder *>(b)->value_builder();
+        }
+        const auto *fixedWidth = dynamic_cast<const arrow::FixedWidthType *>(b->type().get());
+        bytes += fixedWidth ? b->length() * std::max(fixedWidth->bit_width() / 8, 1) : b->length();
+    }
+    return bytes;
+}
+
+/** Finishes the builders into one row group table and leaves the builders empty for the next one */
+std::shared_ptr<arrow::Table> FinishRowGroup(const std::shared_ptr<arrow::Schema> &schema,
+                                             const std::vector<std::shared_ptr<arrow::ArrayBuilder>> &columnBuilders)
+{
+    std::vector<std::shared_ptr<arrow::Array>> arrays;
+    for (const auto &builder : columnBuilders)
+    {
+        std::shared_ptr<arrow::Array> array;
+        PARQUET_THROW_NOT_OK(builder->Finish(&array));
+        arrays.emplace_back(array);
+    }
+    // Create arrow::Table from finalized arrays
+    return arrow::Table::Make(schema, arrays);
+}
+
+/** Range of entries [begin, end) converted by one task */
+struct EntryRange
+{
+    Long64_t begin;
+    Long64_t end;
+};
+
+/**
+ * Splits the entries of the chain into ranges of whole clusters
+ * Consecutive clusters of a file are merged while the range holds at most maxEntries entries
+ */
+std::vector<EntryRange> ClusterRanges(TChain *chain, Long64_t maxEntries)
+{
+    std::vector<EntryRange> ranges;
+    const Long64_t nEntries = chain->GetEntries();
+    Long64_t entry = 0;
+    while (entry < nEntries)
+    {
+        // Clusters are numbered within each file, so ranges do not cross files
+        const Long64_t local = chain->LoadTree(entry);
+        if (local < 0)
+        {
+            throw std::runtime_error("Failed to load entry " + std::to_string(entry));
+        }
+        TTree *tree = chain->GetTree();
+        const Long64_t offset = entry - local;
+        const Long64_t treeEntries = tree->GetEntries();
+        const size_t firstRange = ranges.size();
+        auto clusters = tree->GetClusterIterator(0);
+        Long64_t start = 0;
+        while ((start = clusters()) < treeEntries)
+        {
+            Long64_t end = offset + std::min(clusters.GetNextEntry(), treeEntries);
+            if (ranges.size() > firstRange && end - ranges.back().begin <= maxEntries)
+                ranges.back().end = end;
+            else
+                ranges.push_back({offset + start, end});
+        }
+        entry = offset + treeEntries;
+    }
+    return ranges;
+}
+
+/** Entry range and sampling given on the command line */
+struct EntrySelection
+{
+    Long64_t first = 0;
+    // Last entry converted, -1: up to the end
+    Long64_t last = -1;
+    // >= 1: every sample-th entry from first, < 1: this fraction of the entries, evenly spaced
+    double sample = 1;
+
+    bool IsAll() const { return first == 0 && last < 0 && sample == 1; }
+    bool IsSampled() const { return sample != 1; }
+    /** Whether entry is kept by the sampling */
+    bool Samples(Long64_t entry) const
+    {
+        if (sample >= 1)
+            return (entry - first) % static_cast<Long64_t>(sample) == 0;
+        return std::floor((entry - first + 1) * sample) > std::floor((entry - first) * sample);
+    }
+
+    /**
+     * The same selection in the entries of one file of the chain, which starts at entry offset and has nEntries
+     * first may become negative, so that the sampling continues across files as in the chain.
+     * Returns nullopt if no entry of the file is selected
+     */
+    std::optional<EntrySelection> ForFile(Long64_t offset, Long64_t nEntries) const
+    {
+        EntrySelection selection = *this;
+        selection.first = first - offset;
+        selection.last = last >= 0 ? last - offset : -1;
+        if (selection.first >= nEntries || (last >= 0 && selection.last < 0))
+            return std::nullopt;
+        return selection;
+    }
+};
+
+/** Number of entries of the tree treeName in fileName */
+Long64_t TreeEntries(const std::string &fileName, const std::string &treeName)
+{
+    std::unique_ptr<TFile> file(TFile::Open(fileName.c_str()));
+    if (!file || file->IsZombie())
+    {
+        throw std::runtime_error("Failed to open " + fileName);
+    }
+    auto *tree = file->Get<TTree>(treeName.c_str());
+    if (!tree)
+    {
+        throw std::runtime_error("Tree " + treeName + " not found in " + fileName);
+    }
+    return tree->GetEntries();
+}
+
+/** Clips the ranges to the entries [first, last] and drops the ranges left empty */
+std::vector<EntryRange> ClipRanges(const std::vector<EntryRange> &ranges, const EntrySelection &entries)
+{
+    std::vector<EntryRange> clipped;
+    for (const auto &range : ranges)
+    {
+        Long64_t begin = std::max(range.begin, entries.first);
+        Long64_t end = entries.last >= 0 ? std::min(range.end, entries.last + 1) : range.end;
+        if (begin < end)
+            clipped.push_back({begin, end});
+    }
+    return clipped;
+}
+
+/** Limits of the row groups built by the converters */
+struct RowGroupLimits
+{
+    long long maxEvents = 0;
+    int64_t maxBytes = 0;
+};
+
+/**
+ * Conversion state of one worker thread
+ * ROOT files, trees and readers are not shared between threads, so each worker opens its own
+ */
+struct ConversionContext
+{
+    std::unique_ptr<TChain> chain;
+    // --where expression, evaluated before the entries are converted
+    std::unique_ptr<TTreeFormula> selection;
+    // Updates the leaves of the formula whenever the chain loads a tree, whoever loads it
+    std::unique_ptr<TNotifyLink<TTreeFormula>> selectionNotify;
+    // Declared before the converters so that their TTreeReaderValues are destroyed first
+    std::unique_ptr<TTreeReader> reader;
+    std::vector<std::unique_ptr<ColumnConverter>> converters;
+    std::vector<ColumnConverter *> bulkConverters;
+    std::vector<ColumnConverter *> rowConverters;
+    std::shared_ptr<arrow::Schema> schema;
+    std::vector<std::shared_ptr<arrow::ArrayBuilder>> columnBuilders;
+    ConversionStats *stats = nullptr;
+
+    ~ConversionContext()
+    {
+        if (selectionNotify)
+            selectionNotify->RemoveLink(*chain);
+    }
+
+    /** Reports the phase times of this context and its converters to stats */
+    void SetStats(ConversionStats *s)
+    {
+        stats = s;
+        for (auto &c : converters)
+            c->SetStats(s);
+    }
+};
+
+/**
+ * Chains the trees of the input files and creates the converters of the leaves
+ * A non-empty where is compiled into a TTreeFormula selecting the entries to convert
+ * With restrictBranches, the branches of other leaves are disabled so that they are never read
+ * With check, every file is opened here to make sure it holds the tree
+ */
+std::unique_ptr<ConversionContext> OpenContext(const std::vector<std::string> &inputFiles, const std::string &treeName,
+                                               const std::vector<LeafSpec> &leaves, arrow::MemoryPool *pool, bool bulk,
+                                               const std::string &where, bool restrictBranches, bool check = false)
+{
+    auto ctx = std::make_unique<ConversionContext>();
+    ctx->chain = std::make_unique<TChain>(treeName.c_str());
+    for (const auto &inputFile : inputFiles)
+    {
+        if (ctx->chain->Add(inputFile.c_str(), check ? 0 : TTree::kMaxEntries) == 0)
+        {
+            throw std::runtime_error("Failed to open tree " + treeName + " in " + inputFile);
+        }
+    }
+    // The formula is compiled against the first tree; without entries there is nothing to select
+    if (!where.empty() && ctx->chain->LoadTree(0) >= 0)
+    {
+        ctx->selection = std::make_unique<TTreeFormula>("where", where.c_str(), ctx->chain.get());
+        if (ctx->selection->GetNdim() == 0)
+        {
+            throw std::invalid_argument("Invalid where expression: " + where);
+        }
+        // A chain deletes its previous tree on every load, and may load a tree again at the same number
+        // after others, e.g. for the cluster ranges, so the leaves cannot be cached by tree number
+        ctx->selectionNotify = std::make_unique<TNotifyLink<TTreeFormula>>(ctx->selection.get());
+        ctx->selectionNotify->PrependLink(*ctx->chain);
+    }
+    if (restrictBranches)
+    {
+        // Count branches of variable size arrays are enabled by ROOT along with the arrays
+        ctx->chain->SetBranchStatus("*", false);
+        for (const auto &leaf : leaves)
+        {
+            ctx->chain->SetBranchStatus(leaf.branchName.c_str(), true);
+        }
+        // The where expression may use branches that are not converted
+        for (int i = 0; ctx->selection && i < ctx->selection->GetNcodes(); ++i)
+        {
+            if (TLeaf *leaf = ctx->selection->GetLeaf(i))
+                ctx->chain->SetBranchStatus(leaf->GetBranch()->GetName(), true);
+        }
+    }
+    ctx->reader = std::make_unique<TTreeReader>(ctx->chain.get());
+    // Typed converters resolve their builder and reader once here, not per event
+    ctx->converters = MakeConverters(*ctx->reader, leaves, pool, bulk);
+    for (auto &c : ctx->converters)
+    {
+        (c->IsBulk() ? ctx->bulkConverters : ctx->rowConverters).emplace_back(c.get());
+    }
+    ctx->schema = MakeSchema(ctx->converters, ctx->columnBuilders);
+    return ctx;
+}
+
+/**
+ * Selects the entries [begin, end) kept by the sampling and passing the where formula
+ * As in TTree::CopyTree, an entry passes the formula if any of its instances is non-zero
+ */
+void SelectEntries(ConversionContext &ctx, const EntrySelection &entries, Long64_t begin, Long64_t end,
+                   std::vector<char> &selected)
+{
+    selected.assign(end - begin, 0);
+    for (Long64_t entry = begin; entry < end; ++entry)
+    {
+        if (entries.IsSampled() && !entries.Samples(entry))
+            continue;
+        if (!ctx.selection)
+        {
+            selected[entry - begin] = 1;
+            continue;
+        }
+        // Loading another tree updates the formula leaves through selectionNotify
+        if (ctx.chain->LoadTree(entry) < 0)
+        {
+            throw std::runtime_error("Failed to load entry " + std::to_string(entry));
+        }
+        const int n = ctx.selection->GetNdata();
+        for (int i = 0; i < n; ++i)
+        {
+            if (ctx.selection->EvalInstance(i) != 0)
+            {
+                selected[entry - begin] = 1;
+                break;
             }
-            else if (lType == "ROOT::VecOps::RVec<unsigned int>" || lType == "vector<unsigned int>" || (arrayInfo.isArray && lType == "UInt_t"))
+        }
+    }
+}
+
+/**
+ * Converts the entries of range into row group tables appended to rowGroups
+ * Row groups are closed after limits.maxEvents entries or about limits.maxBytes bytes
+ * Only the entries sampled by entries and passing the where formula of the context are converted
+ */
+void ConvertRange(ConversionContext &ctx, const EntryRange &range, const RowGroupLimits &limits,
+                  const EntrySelection &entries, std::vector<std::shared_ptr<arrow::Table>> &rowGroups)
+{
+    const bool select = ctx.selection || entries.IsSampled();
+    if (!ctx.rowConverters.empty() && ctx.reader->SetEntriesRange(range.begin, range.end) != TTreeReader::kEntryValid)
+    {
+        throw std::runtime_error("Failed to set entry range starting at " + std::to_string(range.begin));
+    }
+    long long rowGroupEvents = 0;
+    Long64_t entry = range.begin;
+    std::vector<char> selected;
+    // Convert in slices of entries between two checks of the row group size
+    while (entry < range.end)
+    {
+        Long64_t sliceEnd = std::min<Long64_t>(range.end, entry + kByteCheckInterval);
+        if (limits.maxEvents > 0)
+        {
+            sliceEnd = std::min<Long64_t>(sliceEnd, entry + limits.maxEvents - rowGroupEvents);
+        }
+        if (select)
+        {
+            PhaseTimer timer(ctx.stats, ConversionStats::kSelect);
+            SelectEntries(ctx, entries, entry, sliceEnd, selected);
+        }
+        {
+            PhaseTimer timer(ctx.stats, ConversionStats::kConvert);
+            rowGroupEvents += ConvertEntries(*ctx.reader, ctx.bulkConverters, ctx.rowConverters, entry, sliceEnd,
+                                             select ? selected.data() : nullptr);
+        }
+        entry = sliceEnd;
+
+        bool flush = (limits.maxEvents > 0 && rowGroupEvents >= limits.maxEvents);
+        if (!flush && limits.maxBytes > 0)
+        {
+            flush = EstimateBufferedBytes(ctx.columnBuilders) >= limits.maxBytes;
+        }
+        if (flush)
+        {
+            PhaseTimer timer(ctx.stats, ConversionStats::kFinish);
+            rowGroups.emplace_back(FinishRowGroup(ctx.schema, ctx.columnBuilders));
+            rowGroupEvents = 0;
+        }
+    }
+    if (rowGroupEvents > 0)
+    {
+        PhaseTimer timer(ctx.stats, ConversionStats::kFinish);
+        rowGroups.emplace_back(FinishRowGroup(ctx.schema, ctx.columnBuilders));
+    }
+}
+
+/** Limits of the part files of a split output, 0: no limit */
+struct FileLimits
+{
+    long long maxRows = 0;
+    int64_t maxBytes = 0;
+};
+
+/**
+ * Writes row groups into the output parquet file
+ * With file limits, the output is a dataset directory [output_file_name]/ of part files
+ * [stem]-00001.parquet, [stem]-00002.parquet, ... and a new part is started after
+ * maxRows rows or once a part has reached maxBytes bytes
+ */
+class OutputWriter
+{
+public:
+    OutputWriter(const std::string &outputFileName, std::shared_ptr<arrow::Schema> schema,
+                 std::shared_ptr<parquet::WriterProperties> properties, const FileLimits &limits, arrow::MemoryPool *pool)
+        : outputFileName_(outputFileName), schema_(std::move(schema)), properties_(std::move(properties)), limits_(limits), pool_(pool)
+    {
+        if (IsSplit())
+        {
+            std::filesystem::create_directories(outputFileName_);
+        }
+        // The first file is created even without rows so that the output always has the schema
+        OpenPart();
+    }
+
+    bool IsSplit() const { return limits_.maxRows > 0 || limits_.maxBytes > 0; }
+    int parts() const { return static_cast<int>(files_.size()); }
+    /** Names of the files written so far */
+    const std::vector<std::string> &files() const { return files_; }
+
+    /** Writes table as a row group, split between part files at the row limit */
+    void WriteRowGroup(const arrow::Table &table)
+    {
+        int64_t offset = 0;
+        while (offset < table.num_rows())
+        {
+            if (!writer_)
+                OpenPart();
+            int64_t rows = table.num_rows() - offset;
+            if (limits_.maxRows > 0)
+                rows = std::min<int64_t>(rows, limits_.maxRows - partRows_);
+            auto slice = table.Slice(offset, rows);
+            PARQUET_THROW_NOT_OK(writer_->WriteTable(*slice, rows));
+            partRows_ += rows;
+            offset += rows;
+
+            bool full = limits_.maxRows > 0 && partRows_ >= limits_.maxRows;
+            if (!full && limits_.maxBytes > 0)
             {
-                builders[lName] = std::make_shared<arrow::UInt32Builder>(pool);
-                builders[lName + "L"] = std::make_shared<arrow::ListBuilder>(pool, builders[lName]);
-                fields[lName + "L"] = (arrow::field(lName, arrow::list(arrow::uint32())));
-                arrayReaders[lName] = new TTreeReaderArray<UInt_t>(reader, lName.c_str());
+                int64_t written = 0;
+                PARQUET_ASSIGN_OR_THROW(written, outfile_->Tell());
+                full = written >= limits_.maxBytes;
+            }
+            if (full)
+                ClosePart();
+        }
+    }
 
-                if (arrayInfo.isFixedSize)
-                {
-                    functions[lName] = [&builders, &arrayReaders, &fixedArraySizes](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        auto *array = (TTreeReaderArray<UInt_t> *)arrayReaders[name];
-                        int expectedSize = fixedArraySizes[name];
-                        int actualSize = array->GetSize();
-                        int size = std::min(expectedSize, actualSize);
-                        for (int i = 0; i < size; ++i)
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::UInt32Builder *>(builders[name].get())->Append((*array)[i]));
-                        }
-                    };
-                }
-                else
+    void Close()
+    {
+        if (writer_)
+            ClosePart();
+    }
+
+private:
+    void OpenPart()
+    {
+        std::string fileName = outputFileName_;
+        if (IsSplit())
+        {
+            char number[16];
+            std::snprintf(number, sizeof(number), "-%05d.parquet", parts() + 1);
+            auto path = std::filesystem::path(outputFileName_);
+            fileName = (path / path.stem()).string() + number;
+        }
+        PARQUET_ASSIGN_OR_THROW(outfile_, arrow::io::FileOutputStream::Open(fileName));
+        PARQUET_ASSIGN_OR_THROW(writer_, parquet::arrow::FileWriter::Open(*schema_, pool_, outfile_, properties_));
+        partRows_ = 0;
+        files_.emplace_back(fileName);
+    }
+
+    void ClosePart()
+    {
+        PARQUET_THROW_NOT_OK(writer_->Close());
+        PARQUET_THROW_NOT_OK(outfile_->Close());
+        writer_.reset();
+        outfile_.reset();
+    }
+
+    std::string outputFileName_;
+    std::shared_ptr<arrow::Schema> schema_;
+    std::shared_ptr<parquet::WriterProperties> properties_;
+    FileLimits limits_;
+    arrow::MemoryPool *pool_;
+    std::shared_ptr<arrow::io::FileOutputStream> outfile_;
+    std::unique_ptr<parquet::arrow::FileWriter> writer_;
+    long long partRows_ = 0;
+    std::vector<std::string> files_;
+};
+
+/** Conversion settings given on the command line */
+struct ConversionSettings
+{
+    std::string treeName = "tree";
+    long long maxRowGroupEvents = 1000000;
+    int64_t maxRowGroupBytes = 256LL * 1024 * 1024;
+    bool bulk = false;
+    WriterConfig writer;
+    NameSelection branches;
+    // TTreeFormula expression selecting the entries to convert, empty: all entries
+    std::string where;
+    // Entries of the chain to convert
+    EntrySelection entries;
+    // Output part file limits, 0: no limit
+    long long maxFileRows = 0;
+    int64_t maxFileBytes = 0;
+};
+
+/**
+ * Converts the trees of the input files, chained in the given order, into one parquet file
+ * Phase times and counters are added to stats
+ * Returns the number of converted events
+ */
+long long ConvertToParquet(const std::vector<std::string> &inputFiles, const std::string &outputFileName,
+                           const ConversionSettings &settings, size_t numThreads, ConversionStats &stats)
+{
+    auto pool = arrow::default_memory_pool();
+    std::optional<PhaseTimer> openTimer(std::in_place, &stats, ConversionStats::kOpen);
+
+    // The leaves are taken from the first file; the first context is also used by the first worker
+    std::vector<std::unique_ptr<ConversionContext>> contexts;
+    std::vector<LeafSpec> allLeaves;
+    {
+        std::unique_ptr<TFile> rfile(TFile::Open(inputFiles.front().c_str()));
+        auto tree = rfile ? (TTree *)rfile->Get(settings.treeName.c_str()) : nullptr;
+        if (!tree)
+        {
+            throw std::runtime_error("Tree " + settings.treeName + " not found in " + inputFiles.front());
+        }
+        allLeaves = ScanLeaves(tree);
+    }
+    std::vector<LeafSpec> leaves;
+    std::copy_if(allLeaves.begin(), allLeaves.end(), std::back_inserter(leaves), [&settings](const LeafSpec &l)
+                 { return settings.branches.Selects(l.name); });
+    if (leaves.empty())
+    {
+        throw std::runtime_error("No branches selected");
+    }
+    const bool restrictBranches = leaves.size() < allLeaves.size();
+    if (restrictBranches)
+    {
+        std::cout << "Converting " << leaves.size() << " of " << allLeaves.size() << " leaves" << std::endl;
+    }
+    contexts.emplace_back(OpenContext(inputFiles, settings.treeName, leaves, pool, settings.bulk, settings.where, restrictBranches, true));
+    std::cout << "Conversion engine: " << (settings.bulk ? "bulk" : "row") << " (" << contexts[0]->bulkConverters.size() << " bulk, "
+              << contexts[0]->rowConverters.size() << " row-wise columns)" << std::endl;
+
+    // Print array size information summary
+    std::cout << "\nArray size information summary:" << std::endl;
+    for (const auto &leaf : leaves)
+    {
+        if (leaf.arrayInfo.isArray && leaf.arrayInfo.isFixedSize)
+        {
+            std::cout << "  " << leaf.name << ": fixed size array [" << leaf.arrayInfo.fixedSize << "]" << std::endl;
+        }
+    }
+    for (const auto &leaf : leaves)
+    {
+        if (!leaf.arrayInfo.isArray || leaf.arrayInfo.isFixedSize)
+            continue;
+        std::cout << "  " << leaf.name << ": variable size array, controlled by branch '" << leaf.arrayInfo.sizeBranch << "'" << std::endl;
+        // Check if the size branch exists
+        bool sizeBranchFound = std::any_of(allLeaves.begin(), allLeaves.end(), [&leaf](const LeafSpec &l)
+                                           { return !l.isList && l.name == leaf.arrayInfo.sizeBranch; });
+        if (!sizeBranchFound)
+        {
+            std::cout << "    WARNING: Size branch '" << leaf.arrayInfo.sizeBranch << "' not found in scalar branches!" << std::endl;
+        }
+    }
+    std::cout << std::endl;
+
+    auto schema = contexts[0]->schema;
+
+    // Tasks are ranges of whole clusters of about one row group each
+    TChain *chain = contexts[0]->chain.get();
+    const Long64_t nEntries = chain->GetEntries();
+    Long64_t taskEntries = settings.maxRowGroupEvents > 0 ? settings.maxRowGroupEvents : (nEntries + numThreads - 1) / numThreads;
+    std::vector<EntryRange> ranges = ClipRanges(ClusterRanges(chain, std::max<Long64_t>(taskEntries, 1)), settings.entries);
+    numThreads = std::max<size_t>(1, std::min(numThreads, ranges.size()));
+    for (size_t i = contexts.size(); i < numThreads; ++i)
+    {
+        contexts.emplace_back(OpenContext(inputFiles, settings.treeName, leaves, pool, settings.bulk, settings.where, restrictBranches));
+    }
+    Long64_t rangeEntries = 0;
+    for (const auto &range : ranges)
+        rangeEntries += range.end - range.begin;
+    std::cout << "Converting " << rangeEntries << " of " << nEntries << " entries of " << inputFiles.size() << " files in " << ranges.size()
+              << " cluster ranges with " << numThreads << " threads" << std::endl;
+
+    auto writer_properties = MakeWriterProperties(settings.writer, *schema, settings.maxRowGroupEvents);
+
+    // Open output parquet file, or the first part file of the dataset directory
+    OutputWriter writer(outputFileName, schema, writer_properties, {settings.maxFileRows, settings.maxFileBytes}, pool);
+    for (auto &ctx : contexts)
+        ctx->SetStats(&stats);
+    openTimer.reset();
+
+    // Workers convert ranges in any order, the main thread writes their row groups in entry order.
+    // Workers do not run further ahead of the writer than maxInFlight ranges to bound memory usage.
+    const RowGroupLimits limits{settings.maxRowGroupEvents, settings.maxRowGroupBytes};
+    const size_t maxInFlight = 2 * numThreads;
+    std::vector<std::vector<std::shared_ptr<arrow::Table>>> results(ranges.size());
+    std::vector<bool> ready(ranges.size(), false);
+    size_t nextTask = 0;
+    size_t nextWrite = 0;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < numThreads; ++t)
+    {
+        workers.emplace_back([&, t]()
+                             {
+            while (true)
+            {
+                size_t task = 0;
                 {
-                    functions[lName] = [&builders, &arrayReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        for (auto &v : *(TTreeReaderArray<UInt_t> *)arrayReaders[name])
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::UInt32Builder *>(builders[name].get())->Append(v));
-                        }
-                    };
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [&]
+                                   { return error || nextTask >= ranges.size() || nextTask < nextWrite + maxInFlight; });
+                    if (error || nextTask >= ranges.size())
+                        return;
+                    task = nextTask++;
                 }
-            }
-            else if (lType == "ROOT::VecOps::RVec<uint64_t>" || lType == "vector<uint64_t>" || (arrayInfo.isArray && lType == "ULong64_t"))
-            {
-                builders[lName] = std::make_shared<arrow::UInt64Builder>(pool);
-                builders[lName + "L"] = std::make_shared<arrow::ListBuilder>(pool, builders[lName]);
-                fields[lName + "L"] = (arrow::field(lName, arrow::list(arrow::uint64())));
-                arrayReaders[lName] = new TTreeReaderArray<ULong64_t>(reader, lName.c_str());
-
-                if (arrayInfo.isFixedSize)
+                std::vector<std::shared_ptr<arrow::Table>> rowGroups;
+                try
                 {
-                    functions[lName] = [&builders, &arrayReaders, &fixedArraySizes](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        auto *array = (TTreeReaderArray<ULong64_t> *)arrayReaders[name];
-                        int expectedSize = fixedArraySizes[name];
-                        int actualSize = array->GetSize();
-                        int size = std::min(expectedSize, actualSize);
-                        for (int i = 0; i < size; ++i)
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::UInt64Builder *>(builders[name].get())->Append((*array)[i]));
-                        }
-                    };
+                    ConvertRange(*contexts[t], ranges[task], limits, settings.entries, rowGroups);
                 }
-                else
+                catch (...)
                 {
-                    functions[lName] = [&builders, &arrayReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        for (auto &v : *(TTreeReaderArray<ULong64_t> *)arrayReaders[name])
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::UInt64Builder *>(builders[name].get())->Append(v));
-                        }
-                    };
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error)
+                        error = std::current_exception();
+                    condition.notify_all();
+                    return;
                 }
+                std::lock_guard<std::mutex> lock(mutex);
+                results[task] = std::move(rowGroups);
+                ready[task] = true;
+                condition.notify_all();
+            } });
+    }
+
+    long long eventCount = 0;
+    long long rowCount = 0;
+    int rowGroupCount = 0;
+    try
+    {
+        for (size_t task = 0; task < ranges.size(); ++task)
+        {
+            std::vector<std::shared_ptr<arrow::Table>> rowGroups;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&]
+                               { return error || ready[task]; });
+                if (error)
+                    break;
+                rowGroups = std::move(results[task]);
             }
-            else if (lType == "ROOT::VecOps::RVec<unsigned short>" || lType == "vector<unsigned short>" || (arrayInfo.isArray && lType == "UShort_t"))
+            for (auto &table : rowGroups)
             {
-                builders[lName] = std::make_shared<arrow::UInt16Builder>(pool);
-                builders[lName + "L"] = std::make_shared<arrow::ListBuilder>(pool, builders[lName]);
-                fields[lName + "L"] = (arrow::field(lName, arrow::list(arrow::uint16())));
-                arrayReaders[lName] = new TTreeReaderArray<UShort_t>(reader, lName.c_str());
-
-                if (arrayInfo.isFixedSize)
-                {
-                    functions[lName] = [&builders, &arrayReaders, &fixedArraySizes](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        auto *array = (TTreeReaderArray<UShort_t> *)arrayReaders[name];
-                        int expectedSize = fixedArraySizes[name];
-                        int actualSize = array->GetSize();
-                        int size = std::min(expectedSize, actualSize);
-                        for (int i = 0; i < size; ++i)
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::UInt16Builder *>(builders[name].get())->Append((*array)[i]));
-                        }
-                    };
-                }
-                else
-                {
-                    functions[lName] = [&builders, &arrayReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        for (auto &v : *(TTreeReaderArray<UShort_t> *)arrayReaders[name])
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::UInt16Builder *>(builders[name].get())->Append(v));
-                        }
-                    };
-                }
+                PhaseTimer timer(&stats, ConversionStats::kWrite);
+                writer.WriteRowGroup(*table);
+                rowGroupCount++;
+                rowCount += table->num_rows();
+                stats.rowGroups++;
+                stats.rows += table->num_rows();
             }
-            else if (lType == "ROOT::VecOps::RVec<bool>" || lType == "vector<bool>" || (arrayInfo.isArray && lType == "Bool_t"))
+            eventCount += ranges[task].end - ranges[task].begin;
+            stats.entries += ranges[task].end - ranges[task].begin;
+            std::cout << "Processed " << eventCount << " events..." << std::endl;
             {
-                builders[lName] = std::make_shared<arrow::BooleanBuilder>(pool);
-                builders[lName + "L"] = std::make_shared<arrow::ListBuilder>(pool, builders[lName]);
-                fields[lName + "L"] = (arrow::field(lName, arrow::list(arrow::boolean())));
-                arrayReaders[lName] = new TTreeReaderArray<Bool_t>(reader, lName.c_str());
-
-                if (arrayInfo.isFixedSize)
-                {
-                    functions[lName] = [&builders, &arrayReaders, &fixedArraySizes](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        auto *array = (TTreeReaderArray<Bool_t> *)arrayReaders[name];
-                        int expectedSize = fixedArraySizes[name];
-                        int actualSize = array->GetSize();
-                        int size = std::min(expectedSize, actualSize);
-                        for (int i = 0; i < size; ++i)
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::BooleanBuilder *>(builders[name].get())->Append((*array)[i]));
-                        }
-                    };
-                }
-                else
-                {
-                    functions[lName] = [&builders, &arrayReaders](const std::string &name)
-                    {
-                        PARQUET_THROW_NOT_OK(static_cast<arrow::ListBuilder *>(builders[name + "L"].get())->Append());
-                        for (auto &v : *(TTreeReaderArray<Bool_t> *)arrayReaders[name])
-                        {
-                            PARQUET_THROW_NOT_OK(static_cast<arrow::BooleanBuilder *>(builders[name].get())->Append(v));
-                        }
-                    };
-                }
+                std::lock_guard<std::mutex> lock(mutex);
+                nextWrite = task + 1;
             }
+            condition.notify_all();
         }
     }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+            error = std::current_exception();
+        condition.notify_all();
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+    {
+        PhaseTimer timer(&stats, ConversionStats::kWrite);
+        writer.Close();
+    }
+    stats.AddOutput(writer.files());
+    std::cout << "Total events processed: " << eventCount;
+    if (!settings.where.empty() || settings.entries.IsSampled())
+        std::cout << ", " << rowCount << " selected";
+    std::cout << " in " << rowGroupCount << " row groups";
+    if (writer.IsSplit())
+        std::cout << " and " << writer.parts() << " part files";
+    std::cout << std::endl;
+    return eventCount;
+}
 
-    // Print array size information summary
-    std::cout << "\nArray size information summary:" << std::endl;
-    for (const auto &pair : fixedArraySizes)
+/**
+ * Expands an input argument into ROOT file names
+ * The argument is a directory (all .root files in it), a glob pattern,
+ * a text file (.txt or .list) with one file name per line, or a single ROOT file
+ */
+std::vector<std::string> ExpandInput(const std::string &input)
+{
+    std::vector<std::string> files;
+    if (std::filesystem::is_directory(input))
     {
-        std::cout << "  " << pair.first << ": fixed size array [" << pair.second << "]" << std::endl;
+        for (const auto &entry : std::filesystem::directory_iterator(input))
+        {
+            if (entry.is_regular_file() && entry.path().extension() == ".root")
+                files.emplace_back(entry.path().string());
+        }
+        std::sort(files.begin(), files.end());
     }
-    for (const auto &pair : arraySizeBranches)
+    else if (input.find_first_of("*?[") != std::string::npos)
     {
-        std::cout << "  " << pair.first << ": variable size array, controlled by branch '" << pair.second << "'" << std::endl;
-        // Check if the size branch exists
-        bool sizeBranchFound = false;
-        for (const auto &vr : valueReaders)
+        glob_t matches;
+        if (glob(input.c_str(), 0, nullptr, &matches) == 0)
         {
-            if (vr.first == pair.second)
-            {
-                sizeBranchFound = true;
-                break;
-            }
+            for (size_t i = 0; i < matches.gl_pathc; ++i)
+                files.emplace_back(matches.gl_pathv[i]);
         }
-        if (!sizeBranchFound)
+        globfree(&matches);
+    }
+    else if (std::filesystem::path(input).extension() == ".txt" || std::filesystem::path(input).extension() == ".list")
+    {
+        std::ifstream list(input);
+        if (!list)
+        {
+            throw std::runtime_error("Failed to open file list " + input);
+        }
+        std::string line;
+        while (std::getline(list, line))
         {
-            std::cout << "    WARNING: Size branch '" << pair.second << "' not found in scalar branches!" << std::endl;
+            line.erase(0, line.find_first_not_of(" \t"));
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (!line.empty() && line[0] != '#')
+                files.emplace_back(line);
         }
     }
-    std::cout << std::endl;
+    else
+    {
+        files.emplace_back(input);
+    }
+    if (files.empty())
+    {
+        throw std::runtime_error("No input files found for " + input);
+    }
+    return files;
+}
 
-    // Event loop
-    long long eventCount = 0;
-    while (reader.Next())
+/**
+ * Names of the parquet files of the input files in an output directory
+ * The output directory mirrors the input files below their common directory, so that inputs with the
+ * same stem in different directories (a/run.root, b/run.root) are written into a/run.parquet and b/run.parquet
+ */
+std::vector<std::filesystem::path> PerFileOutputNames(const std::vector<std::string> &inputFiles, const std::string &outputDirectory)
+{
+    std::vector<std::filesystem::path> parents;
+    for (const auto &input : inputFiles)
+        parents.push_back(std::filesystem::absolute(input).lexically_normal().parent_path());
+    std::filesystem::path commonRoot = parents.front();
+    for (const auto &parent : parents)
     {
-        // Fill scalar values first (including size variables)
-        for (auto &r : valueReaders)
+        auto [rootEnd, parentEnd] = std::mismatch(commonRoot.begin(), commonRoot.end(), parent.begin(), parent.end());
+        std::filesystem::path common;
+        for (auto it = commonRoot.begin(); it != rootEnd; ++it)
+            common /= *it;
+        commonRoot = common;
+    }
+    std::vector<std::filesystem::path> outputs;
+    for (size_t i = 0; i < inputFiles.size(); ++i)
+    {
+        auto output = std::filesystem::path(outputDirectory) / parents[i].lexically_relative(commonRoot) / std::filesystem::path(inputFiles[i]).stem();
+        output += ".parquet";
+        outputs.push_back(output.lexically_normal());
+    }
+    // The same file given twice would still be converted twice into one output
+    std::vector<std::filesystem::path> sorted = outputs;
+    std::sort(sorted.begin(), sorted.end());
+    auto duplicate = std::adjacent_find(sorted.begin(), sorted.end());
+    if (duplicate != sorted.end())
+    {
+        throw std::runtime_error("Several input files would be written into " + duplicate->string());
+    }
+    return outputs;
+}
+
+// Main function
+int main(int argc, char **argv)
+{
+    /** parsing commandline arguments **/
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> inputs;
+    std::string output_file_name = "default";
+    std::string engine = "row";
+    size_t num_threads = 1;
+    ConversionSettings settings;
+    std::string stats_json;
+    double stats_interval = 0;
+    bool branch_timing = false;
+    enum LongOnlyOptions
+    {
+        kMaxFileRows = 256,
+        kMaxFileBytes,
+        kInclude,
+        kExclude,
+        kIncludeRegex,
+        kExcludeRegex,
+        kWhere,
+        kFirst,
+        kLast,
+        kSample,
+        kStatsJson,
+        kStatsInterval,
+        kBranchTiming
+    };
+    const struct option long_options[] = {
+        {"compression", required_argument, nullptr, 'c'},
+        {"compression-level", required_argument, nullptr, 'l'},
+        {"dictionary", required_argument, nullptr, 'd'},
+        {"page-size", required_argument, nullptr, 'p'},
+        {"statistics", required_argument, nullptr, 's'},
+        {"max-file-rows", required_argument, nullptr, kMaxFileRows},
+        {"max-file-bytes", required_argument, nullptr, kMaxFileBytes},
+        {"include", required_argument, nullptr, kInclude},
+        {"exclude", required_argument, nullptr, kExclude},
+        {"include-regex", required_argument, nullptr, kIncludeRegex},
+        {"exclude-regex", required_argument, nullptr, kExcludeRegex},
+        {"where", required_argument, nullptr, kWhere},
+        {"first", required_argument, nullptr, kFirst},
+        {"last", required_argument, nullptr, kLast},
+        {"sample", required_argument, nullptr, kSample},
+        {"stats-json", required_argument, nullptr, kStatsJson},
+        {"stats-interval", required_argument, nullptr, kStatsInterval},
+        {"branch-timing", no_argument, nullptr, kBranchTiming},
+        {nullptr, 0, nullptr, 0}};
+    int opt = 0;
+    // Bad values (numbers, on/off, regexes) are reported like the errors of the conversion
+    try
+    {
+        while ((opt = getopt_long(argc, argv, "i:o:t:n:m:e:j:c:l:d:p:s:", long_options, nullptr)) != -1)
         {
-            std::string brName = r.first;
-            functions[brName](brName);
+            switch (opt)
+            {
+            case 'i':
+                inputs.emplace_back(optarg);
+                break;
+            case 'o':
+                output_file_name = optarg;
+                break;
+            case 't':
+                settings.treeName = optarg;
+                break;
+            case 'n':
+                settings.maxRowGroupEvents = std::stoll(optarg);
+                break;
+            case 'm':
+                settings.maxRowGroupBytes = std::stoll(optarg);
+                break;
+            case 'e':
+                engine = optarg;
+                if (engine != "row" && engine != "bulk")
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                settings.bulk = engine == "bulk";
+                break;
+            case 'j':
+                num_threads = std::stoul(optarg);
+                break;
+            case 'c':
+                settings.writer.compression = optarg;
+                break;
+            case 'l':
+                settings.writer.compressionLevel = std::stoi(optarg);
+                break;
+            case 'd':
+                settings.writer.dictionary = optarg;
+                break;
+            case 'p':
+                settings.writer.pageSize = std::stoll(optarg);
+                break;
+            case 's':
+                settings.writer.statistics = ParseOnOff(optarg);
+                break;
+            case kMaxFileRows:
+                settings.maxFileRows = std::stoll(optarg);
+                break;
+            case kMaxFileBytes:
+                settings.maxFileBytes = std::stoll(optarg);
+                break;
+            case kInclude:
+                for (const auto &name : SplitList(optarg))
+                    settings.branches.include.emplace_back(name);
+                break;
+            case kExclude:
+                for (const auto &name : SplitList(optarg))
+                    settings.branches.exclude.emplace_back(name);
+                break;
+            case kIncludeRegex:
+            case kExcludeRegex:
+                try
+                {
+                    (opt == kIncludeRegex ? settings.branches.includeRegex : settings.branches.excludeRegex) = std::regex(optarg);
+                }
+                catch (const std::regex_error &e)
+                {
+                    std::cerr << "Error: invalid regex " << optarg << ": " << e.what() << std::endl;
+                    return 1;
+                }
+                break;
+            case kWhere:
+                settings.where = optarg;
+                break;
+            case kFirst:
+                settings.entries.first = std::stoll(optarg);
+                break;
+            case kLast:
+                settings.entries.last = std::stoll(optarg);
+                break;
+            case kSample:
+                settings.entries.sample = std::stod(optarg);
+                if (settings.entries.sample <= 0 || (settings.entries.sample > 1 && settings.entries.sample != std::floor(settings.entries.sample)))
+                {
+                    std::cerr << "Error: --sample takes an integer stride or a fraction in (0, 1]" << std::endl;
+                    return 1;
+                }
+                break;
+            case kStatsJson:
+                stats_json = optarg;
+                break;
+            case kStatsInterval:
+                stats_interval = std::stod(optarg);
+                break;
+            case kBranchTiming:
+                branch_timing = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+                break;
+            }
         }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    // Arguments after the options are inputs too, e.g. from a glob expanded by the shell
+    for (int i = optind; i < argc; ++i)
+    {
+        inputs.emplace_back(argv[i]);
+    }
 
-        // Then fill arrays (they may depend on size variables)
-        for (auto &r : arrayReaders)
+    std::vector<std::string> input_files;
+    try
+    {
+        for (const auto &input : inputs)
         {
-            std::string brName = r.first;
-            functions[brName](brName);
+            auto files = ExpandInput(input);
+            input_files.insert(input_files.end(), files.begin(), files.end());
         }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    if (input_files.empty())
+    {
+        std::cerr << "Error: no input file given" << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
 
-        eventCount++;
-        if (eventCount % 10000 == 0)
+    // The default output file name will be [input_file_name -.root].parquet
+    if (output_file_name == "default")
+    {
+        if (input_files.size() > 1)
         {
-            std::cout << "Processed " << eventCount << " events..." << std::endl;
+            std::cerr << "Error: -o is required with more than one input file" << std::endl;
+            return 1;
         }
+        output_file_name = input_files[0].substr(0, input_files[0].length() - 4) + "parquet";
+        std::cout << "output_file_name = " << output_file_name << std::endl;
     }
-    std::cout << "Total events processed: " << eventCount << std::endl;
 
-    arrow::FieldVector fieldVec;
-    // Finalize arrays
-    std::vector<std::shared_ptr<arrow::Array>> arrays;
-    for (auto &builder : builders)
+    if (num_threads == 0)
     {
-        std::string brName = builder.first;
-        std::shared_ptr<arrow::Array> array;
-        if (builders.find(brName + "L") == builders.end())
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    ROOT::EnableThreadSafety();
+
+    ConversionStats stats(branch_timing);
+    int status = 0;
+    {
+        StatsReporter reporter(stats, stats_interval, stats_json);
+        // An output directory gets one parquet file per input file, converted concurrently
+        const bool per_file = output_file_name.back() == '/' || std::filesystem::is_directory(output_file_name);
+        if (!per_file)
         {
-            PARQUET_THROW_NOT_OK(builder.second->Finish(&array));
-            fieldVec.emplace_back(fields[brName]);
-            arrays.emplace_back(array);
+            try
+            {
+                ConvertToParquet(input_files, output_file_name, settings, num_threads, stats);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: " << e.what() << std::endl;
+                status = 1;
+            }
+        }
+        else
+        {
+            std::vector<std::filesystem::path> output_names;
+            try
+            {
+                output_names = PerFileOutputNames(input_files, output_file_name);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: " << e.what() << std::endl;
+                return 1;
+            }
+            // --first, --last and --sample count the entries of the chain of all files, as with a single output file
+            std::vector<std::optional<EntrySelection>> file_entries(input_files.size(), settings.entries);
+            if (!settings.entries.IsAll())
+            {
+                Long64_t offset = 0;
+                for (size_t i = 0; i < input_files.size(); ++i)
+                {
+                    try
+                    {
+                        const Long64_t n_entries = TreeEntries(input_files[i], settings.treeName);
+                        file_entries[i] = settings.entries.ForFile(offset, n_entries);
+                        offset += n_entries;
+                    }
+                    catch (const std::exception &e)
+                    {
+                        // The entries of the following files could not be numbered
+                        std::cerr << "Error: " << e.what() << std::endl;
+                        return 1;
+                    }
+                }
+            }
+            const size_t concurrent_files = std::min(num_threads, input_files.size());
+            const size_t threads_per_file = std::max<size_t>(1, num_threads / input_files.size());
+            std::cout << "Converting " << input_files.size() << " files into " << output_file_name << ", "
+                      << concurrent_files << " at a time" << std::endl;
+            std::atomic<size_t> next_file{0};
+            std::atomic<int> failures{0};
+            std::atomic<size_t> written{0};
+            std::vector<std::thread> file_workers;
+            for (size_t t = 0; t < concurrent_files; ++t)
+            {
+                file_workers.emplace_back([&]()
+                                          {
+                    for (size_t i = next_file++; i < input_files.size(); i = next_file++)
+                    {
+                        if (!file_entries[i])
+                        {
+                            std::cout << "Skipping " << input_files[i] << ": no entries selected" << std::endl;
+                            continue;
+                        }
+                        try
+                        {
+                            ConversionSettings file_settings = settings;
+                            file_settings.entries = *file_entries[i];
+                            std::filesystem::create_directories(output_names[i].parent_path());
+                            ConvertToParquet({input_files[i]}, output_names[i].string(), file_settings, threads_per_file, stats);
+                            written++;
+                        }
+                        catch (const std::exception &e)
+                        {
+                            std::cerr << "Error converting " << input_files[i] << ": " << e.what() << std::endl;
+                            failures++;
+                        }
+                    } });
+            }
+            for (auto &worker : file_workers)
+            {
+                worker.join();
+            }
+            std::cout << "Converted " << written << " of " << input_files.size() << " files" << std::endl;
+            status = failures > 0 ? 1 : 0;
         }
     }
-    // Generate schema from fields
-    auto schema = arrow::schema(fieldVec);
-    // Create arrow::Table from finalized arrays
-    auto table = arrow::Table::Make(schema, arrays);
-
-    // Open output parquet file
-    std::shared_ptr<arrow::io::FileOutputStream> outfile;
-    PARQUET_ASSIGN_OR_THROW(
-        outfile,
-        arrow::io::FileOutputStream::Open(output_file_name));
-
-    // Write table to the file
-    // auto writer_properties = parquet::WriterProperties::Builder()
-    //                              .compression(parquet::Compression::ZSTD)
-    //                              ->build();
-    // PARQUET_THROW_NOT_OK(
-    //     parquet::arrow::WriteTable(*table, pool_, outfile, 1048576L, writer_properties));
-    PARQUET_THROW_NOT_OK(parquet::arrow::WriteTable(*table, pool, outfile));
-
-    return 0;
+    std::cout << stats.Summary() << std::endl;
+    stats.WriteJson(stats_json);
+    return status;
 }